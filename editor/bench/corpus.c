@@ -0,0 +1,165 @@
+// reproducible corpora for bench/kernels: the same kind, size and seed
+// always give the same bytes
+//
+//   corpus c|tabs|json|log MB [seed] > file
+//
+// c is a long C file, tabs the same code indented with tabs plus tab
+// separated tables, json one huge line, log timestamped lines; MB may run
+// to several GB for log.
+#define _DEFAULT_SOURCE
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static unsigned long long seed = 0x9e3779b97f4a7c15ULL;
+
+static unsigned rnd(unsigned n) {
+  seed ^= seed << 13;
+  seed ^= seed >> 7;
+  seed ^= seed << 17;
+  return (unsigned) ((seed >> 32) % n);
+}
+
+static const char *words[] = {
+  "row", "buffer", "cursor", "render", "screen", "index", "frame", "query",
+  "match", "leaf", "node", "text", "state", "chunk", "task", "line", "size",
+  "count", "offset", "width", "value", "result", "length", "key", "event"
+};
+#define NWORDS (sizeof(words) / sizeof(words[0]))
+
+static const char *word() {
+  return words[rnd(NWORDS)];
+}
+
+static const char *levels[] = { "INFO", "INFO", "INFO", "DEBUG", "WARN", "ERROR" };
+
+static size_t out;
+
+static void emit(const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vprintf(fmt, ap);
+  va_end(ap);
+  if (n > 0) out += n;
+}
+
+static void indent(int depth, int tabs) {
+  for (int j = 0; j < depth; j++) emit(tabs ? "\t" : "    ");
+}
+
+// one function of plausible C, with comments, strings and numbers
+static void cFunction(int tabs) {
+  static int serial;
+  int id = serial++;
+  if (rnd(3) == 0) {
+    emit("/*\n * %s the %s of a %s, keeping its %s\n * when the %s is %s\n */\n",
+         word(), word(), word(), word(), word(), word());
+  } else {
+    emit("// %s every %s in the %s\n", word(), word(), word());
+  }
+  emit("int %s_%s_%d(struct %s *%s, int %s) {\n", word(), word(), id, word(), word(), word());
+  int lines = 4 + rnd(20), depth = 1;
+  for (int j = 0; j < lines; j++) {
+    indent(depth, tabs);
+    switch (rnd(8)) {
+      case 0:
+        if (depth == 4) {
+          emit("continue;\n");
+          break;
+        }
+        emit("if (%s->%s > %u && %s != NULL) {\n", word(), word(), rnd(4096), word());
+        depth++;
+        break;
+      case 1:
+        emit("for (int j = 0; j < %s->%s; j++) %s[j] = %s(%s, j);\n",
+             word(), word(), word(), word(), word());
+        break;
+      case 2:
+        emit("snprintf(%s, sizeof(%s), \"%%d %s %s\\n\", %s);\n",
+             word(), word(), word(), word(), word());
+        break;
+      case 3:
+        emit("%s += %s * 0x%x + %u.%u;  /* %s */\n", word(), word(), rnd(65536),
+             rnd(100), rnd(100), word());
+        break;
+      case 4:
+        if (depth > 1) {
+          emit("}\n");
+          depth--;
+          break;
+        }
+        /* fall through */
+      default:
+        emit("%s = %s(%s, %s->%s, '%c');\n", word(), word(), word(), word(),
+             word(), 'a' + rnd(26));
+        break;
+    }
+  }
+  while (depth > 1) {
+    indent(--depth, tabs);
+    emit("}\n");
+  }
+  indent(1, tabs);
+  emit("return %s;\n}\n\n", word());
+}
+
+static void tabTable() {
+  int cols = 3 + rnd(6), rows = 5 + rnd(30);
+  emit("/* %s table\n", word());
+  for (int r = 0; r < rows; r++) {
+    for (int c = 0; c < cols; c++)
+      emit(c ? "\t%s%u" : "%s%u", word(), rnd(1000));
+    emit("\n");
+  }
+  emit("*/\n\n");
+}
+
+static void jsonRecord(int first) {
+  emit("%s{\"id\":%u,\"name\":\"%s %s\",\"tags\":[\"%s\",\"%s\",\"%s\"],"
+       "\"score\":%u.%02u,\"active\":%s,\"parent\":%s,\"%s\":{\"%s\":%u,\"%s\":\"%s\"}}",
+       first ? "" : ",", rnd(1000000), word(), word(), word(), word(), word(),
+       rnd(100), rnd(100), rnd(2) ? "true" : "false", rnd(4) ? "null" : "0",
+       word(), word(), rnd(1 << 20), word(), word());
+}
+
+static void logLine(unsigned long n) {
+  unsigned long s = 1760000000UL + n / 50;
+  emit("2026-10-%02lu %02lu:%02lu:%02lu.%03u %-5s [%s-%u] %s %s id=%08x took %ums",
+       1 + s / 86400 % 28, s / 3600 % 24, s / 60 % 60, s % 60, rnd(1000),
+       levels[rnd(6)], word(), rnd(16), word(), word(), rnd(1u << 31), rnd(2000));
+  if (rnd(5) == 0) emit(" msg=\"%s %s %s\"", word(), word(), word());
+  emit("\n");
+}
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    fprintf(stderr, "usage: corpus c|tabs|json|log MB [seed]\n");
+    return 1;
+  }
+  size_t limit = (size_t) strtoull(argv[2], NULL, 10) << 20;
+  if (argc > 3) seed ^= strtoull(argv[3], NULL, 10) * 0x2545f4914f6cdd1dULL;
+  static char buf[1 << 20];
+  setvbuf(stdout, buf, _IOFBF, sizeof(buf));
+
+  const char *kind = argv[1];
+  if (strcmp(kind, "c") == 0 || strcmp(kind, "tabs") == 0) {
+    int tabs = kind[0] == 't';
+    emit("#include <stdio.h>\n#include <string.h>\n\n");
+    while (out < limit) {
+      if (tabs && rnd(4) == 0) tabTable();
+      else cFunction(tabs);
+    }
+  } else if (strcmp(kind, "json") == 0) {
+    emit("[");
+    for (int first = 1; out < limit; first = 0) jsonRecord(first);
+    emit("]\n");
+  } else if (strcmp(kind, "log") == 0) {
+    for (unsigned long n = 0; out < limit; n++) logLine(n);
+  } else {
+    fprintf(stderr, "corpus: unknown kind %s\n", kind);
+    return 1;
+  }
+  return fflush(stdout) == 0 ? 0 : 1;
+}
@@ -0,0 +1,194 @@
+// micro-benchmarks of the editor's hot loops over one file, usually a
+// corpus from bench/corpus; prints a JSON object per kernel with its ns per
+// op and, where it walks text, MB/s
+//
+//   kernels file [min-ms]
+//
+// each kernel is run until it has taken min-ms, 200 by default. The
+// editor is built in, headless, with the task pool off so everything is
+// timed on this thread.
+#define ZUMA_NO_MAIN
+#include "../zuma.c"
+
+static const char *corpus;
+static unsigned long long min_ns = 200000000ULL;
+
+static unsigned long long benchNow() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+static void benchReport(const char *kernel, unsigned long long ops,
+                        unsigned long long bytes, unsigned long long ns) {
+  printf("{\"corpus\":\"%s\",\"kernel\":\"%s\",\"ops\":%llu,\"bytes\":%llu,"
+         "\"ns\":%llu,\"ns_per_op\":%.2f,\"mb_per_s\":%.1f}\n",
+         corpus, kernel, ops, bytes, ns, ops ? (double) ns / ops : 0.0,
+         ns ? bytes * 1e3 / ns : 0.0);
+  fflush(stdout);
+}
+
+static unsigned long long textBytes() {
+  unsigned long long bytes = 0;
+  for (int r = 0; r < conf.nrows; r++) bytes += editorRowAt(r)->size;
+  return bytes;
+}
+
+static void releaseAll() {
+  for (struct ropeNode *leaf = ropeFirstLeaf(); leaf; leaf = leaf->next)
+    for (int j = 0; j < leaf->n; j++) editorRowRelease(leaf->u.rows[j]);
+}
+
+static void benchRowsToString(const char *kernel) {
+  unsigned long long ops = 0, bytes = 0, ns = 0;
+  while (ns < min_ns) {
+    size_t len;
+    unsigned long long t0 = benchNow();
+    char *s = editorRowsToString(&len);
+    ns += benchNow() - t0;
+    free(s);
+    ops++;
+    bytes += len;
+  }
+  benchReport(kernel, ops, bytes, ns);
+}
+
+// editorUpdateRender, which tab-free rows get through by aliasing chars
+static void benchRender(unsigned long long text) {
+  unsigned long long ops = 0, bytes = 0, ns = 0;
+  while (ns < min_ns) {
+    releaseAll();
+    unsigned long long t0 = benchNow();
+    for (struct ropeNode *leaf = ropeFirstLeaf(); leaf; leaf = leaf->next)
+      for (int j = 0; j < leaf->n; j++) editorUpdateRender(leaf->u.rows[j]);
+    ns += benchNow() - t0;
+    ops += conf.nrows;
+    bytes += text;
+  }
+  benchReport("render", ops, bytes, ns);
+}
+
+// editorUpdateSyntax top to bottom from nothing highlighted, as paging
+// through the whole file would
+static void benchSyntax(unsigned long long text) {
+  unsigned long long ops = 0, bytes = 0, ns = 0;
+  while (ns < min_ns) {
+    releaseAll();
+    conf.hl_gen++;
+    conf.hl_frontier = 0;
+    unsigned long long t0 = benchNow();
+    for (int r = 0; r < conf.nrows; r++) editorUpdateSyntax(r);
+    ns += benchNow() - t0;
+    ops += conf.nrows;
+    bytes += text;
+  }
+  releaseAll();
+  benchReport("syntax", ops, bytes, ns);
+}
+
+// cursor columns to screen columns and back, at random places
+#define BENCH_SPOTS 4096
+static void benchCursor() {
+  static struct editorRow *rows[BENCH_SPOTS];
+  static int cols[BENCH_SPOTS];
+  for (int j = 0; j < BENCH_SPOTS; j++) {
+    rows[j] = editorRowAt(rand() % conf.nrows);
+    cols[j] = rand() % (rows[j]->size + 1);
+  }
+  volatile int sink = 0;
+  for (int kernel = 0; kernel < 2; kernel++) {
+    unsigned long long ops = 0, bytes = 0, ns = 0;
+    // a few spots between clock reads, as one spot of a long line can
+    // take milliseconds
+    for (int j = 0; ns < min_ns; ) {
+      unsigned long long t0 = benchNow();
+      for (int k = 0; k < 64; k++, j = (j + 1) % BENCH_SPOTS) {
+        if (kernel == 0) sink += editorRowCxToRx(rows[j], cols[j]);
+        else sink += editorRowRxToCx(rows[j], cols[j]);
+        bytes += cols[j];
+      }
+      ns += benchNow() - t0;
+      ops += 64;
+    }
+    benchReport(kernel == 0 ? "cx_to_rx" : "rx_to_cx", ops, bytes, ns);
+  }
+  (void) sink;
+}
+
+// a screen of rows at a time down the file, as far as BENCH_FRAMES screens
+#define BENCH_FRAMES 4096
+static void benchDraw() {
+  unsigned long long ops = 0, ns = 0;
+  while (ns < min_ns) {
+    conf.screen_valid = 0;
+    for (int f = 0; f < BENCH_FRAMES && f * conf.screenrows < conf.nrows; f++) {
+      conf.rowoff = f * conf.screenrows;
+      unsigned long long t0 = benchNow();
+      screenClear(&conf.frame);
+      editorDrawRows(&conf.frame);
+      ns += benchNow() - t0;
+      ops++;
+    }
+  }
+  conf.rowoff = 0;
+  releaseAll();
+  benchReport("draw_rows", ops, 0, ns);
+}
+
+// the scan behind editorFindCallback, for a query found nowhere so every
+// byte is looked at
+static void benchSearch(const char *kernel, const char *q, int regex,
+                        unsigned long long text) {
+  struct editorSearch *s = &conf.search;
+  unsigned long long ops = 0, bytes = 0, ns = 0;
+  while (ns < min_ns) {
+    s->nmatches = 0;
+    unsigned long long t0 = benchNow();
+    editorSearchStart(q, strlen(q), regex);
+    ns += benchNow() - t0;
+    ops++;
+    bytes += text;
+  }
+  editorSearchReset();
+  benchReport(kernel, ops, bytes, ns);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: kernels file [min-ms]\n");
+    return 1;
+  }
+  corpus = argv[1];
+  if (argc > 2) min_ns = strtoull(argv[2], NULL, 10) * 1000000ULL;
+  setenv("ZUMA_THREADS", "0", 1);
+  setenv("ZUMA_INDEX", "0", 0);
+  srand(1);
+
+  // the replay's virtual screen stands in for a terminal
+  static char nokeys[1];
+  conf.replay.keys = nokeys;
+  conf.replay.rows = 50;
+  conf.replay.cols = 160;
+  initEditor();
+  editorInitEvents();
+  editorTasksInit();
+  editorLoadSyntax();
+  editorOpen(argv[1]);
+  if (conf.nrows == 0) die("empty corpus");
+
+  // a file just opened is still lines of the mapping
+  unsigned long long text = conf.map.data ? conf.map.len : 0;
+  if (text) {
+    benchRowsToString("rows_to_string_mapped");
+    benchSearch("search_mapped", "qzxjq", 0, text);
+  }
+  text = textBytes();
+  benchRowsToString("rows_to_string");
+  benchRender(text);
+  benchSyntax(text);
+  benchCursor();
+  benchDraw();
+  benchSearch("search", "qzxjq", 0, text);
+  benchSearch("search_regex", "q[0-9]zx", 1, text);
+  return 0;
+}
@@ -0,0 +1,651 @@
+// regular expressions for search: a pattern is parsed once into a Thompson
+// NFA and matched through a DFA whose states are only built as the text
+// reaches them, so scanning a row never backtracks and stays linear.
+//
+// supported: literals, ., [...] and [^...] classes, \d \w \s \D \W \S,
+// ^ $ anchors, ( ) groups, | and the * + ? {m} {m,} {m,n} repeats.
+// matches are leftmost-longest.
+
+#include <stdlib.h>
+#include <string.h>
+#include "zuma.h"
+
+#define RX_MAX_REPEAT 1000
+#define RX_MAX_STATES 50000     // NFA size limit, guards nested {m,n}
+#define DFA_MAX_STATES 2048     // cached DFA states before starting over
+
+/*** parser ***/
+
+enum rxNodeType {
+  RX_SET,
+  RX_EMPTY,
+  RX_BOL,
+  RX_EOL,
+  RX_CAT,
+  RX_ALT,
+  RX_STAR,
+  RX_PLUS,
+  RX_QUEST,
+  RX_REPEAT
+};
+
+struct rxNode {
+  int type;
+  int min, max;                 // RX_REPEAT bounds, max -1 for no limit
+  unsigned char set[32];        // bytes an RX_SET matches
+  struct rxNode *a, *b;
+};
+
+struct rxParser {
+  const char *p;
+  const char *err;
+};
+
+#define SET_ADD(set, c) ((set)[(unsigned char) (c) >> 3] |= 1 << ((c) & 7))
+#define SET_HAS(set, c) ((set)[(unsigned char) (c) >> 3] & (1 << ((c) & 7)))
+
+struct rxNode *rxNew(int type, struct rxNode *a, struct rxNode *b) {
+  struct rxNode *node = calloc(1, sizeof(struct rxNode));
+  if (!node) return NULL;
+  node->type = type;
+  node->a = a;
+  node->b = b;
+  return node;
+}
+
+void rxFreeNode(struct rxNode *node) {
+  if (!node) return;
+  rxFreeNode(node->a);
+  rxFreeNode(node->b);
+  free(node);
+}
+
+void rxSetRange(unsigned char *set, int from, int to) {
+  for (int c = from; c <= to; c++) SET_ADD(set, c);
+}
+
+// fill set for a backslash class such as \d, returning 0 if c is not one
+int rxClassEscape(unsigned char *set, int c) {
+  unsigned char tmp[32];
+  memset(tmp, 0, sizeof(tmp));
+  switch (c | 0x20) {
+    case 'd':
+      rxSetRange(tmp, '0', '9');
+      break;
+    case 'w':
+      rxSetRange(tmp, '0', '9');
+      rxSetRange(tmp, 'a', 'z');
+      rxSetRange(tmp, 'A', 'Z');
+      SET_ADD(tmp, '_');
+      break;
+    case 's':
+      SET_ADD(tmp, ' ');
+      rxSetRange(tmp, '\t', '\r');
+      break;
+    default:
+      return 0;
+  }
+  // the upper case forms match everything else
+  for (int j = 0; j < 32; j++) set[j] |= (c >= 'a') ? tmp[j] : ~tmp[j];
+  return 1;
+}
+
+int rxEscapeChar(int c) {
+  switch (c) {
+    case 't': return '\t';
+    case 'n': return '\n';
+    case 'r': return '\r';
+    default: return c;
+  }
+}
+
+struct rxNode *rxParseClass(struct rxParser *ps) {
+  struct rxNode *node = rxNew(RX_SET, NULL, NULL);
+  if (!node) return NULL;
+  int negate = 0;
+  if (*ps->p == '^') {
+    negate = 1;
+    ps->p++;
+  }
+  int first = 1;
+  while (*ps->p && (*ps->p != ']' || first)) {
+    first = 0;
+    int c = (unsigned char) *ps->p++;
+    if (c == '\\' && *ps->p) {
+      c = (unsigned char) *ps->p++;
+      if (rxClassEscape(node->set, c)) continue;
+      c = rxEscapeChar(c);
+    }
+    if (ps->p[0] == '-' && ps->p[1] && ps->p[1] != ']') {
+      int to = (unsigned char) ps->p[1];
+      ps->p += 2;
+      if (to == '\\' && *ps->p) to = rxEscapeChar((unsigned char) *ps->p++);
+      if (to < c) {
+        ps->err = "bad range";
+        return node;
+      }
+      rxSetRange(node->set, c, to);
+    } else {
+      SET_ADD(node->set, c);
+    }
+  }
+  if (*ps->p != ']') {
+    ps->err = "missing ]";
+    return node;
+  }
+  ps->p++;
+  if (negate) for (int j = 0; j < 32; j++) node->set[j] = ~node->set[j];
+  return node;
+}
+
+struct rxNode *rxParseAlt(struct rxParser *ps);
+
+struct rxNode *rxParseAtom(struct rxParser *ps) {
+  int c = (unsigned char) *ps->p++;
+  struct rxNode *node;
+  switch (c) {
+    case '(':
+      node = rxParseAlt(ps);
+      if (ps->err) return node;
+      if (*ps->p != ')') ps->err = "missing )";
+      else ps->p++;
+      return node;
+    case '[':
+      return rxParseClass(ps);
+    case '^':
+      return rxNew(RX_BOL, NULL, NULL);
+    case '$':
+      return rxNew(RX_EOL, NULL, NULL);
+    case '*': case '+': case '?': case '{':
+      ps->err = "nothing to repeat";
+      return NULL;
+  }
+  node = rxNew(RX_SET, NULL, NULL);
+  if (!node) return NULL;
+  if (c == '.') {
+    memset(node->set, 0xff, sizeof(node->set));
+  } else if (c == '\\' && *ps->p) {
+    c = (unsigned char) *ps->p++;
+    if (!rxClassEscape(node->set, c)) SET_ADD(node->set, rxEscapeChar(c));
+  } else {
+    SET_ADD(node->set, c);
+  }
+  return node;
+}
+
+int rxParseInt(struct rxParser *ps) {
+  int n = 0;
+  if (*ps->p < '0' || *ps->p > '9') return -1;
+  while (*ps->p >= '0' && *ps->p <= '9') {
+    n = n * 10 + (*ps->p++ - '0');
+    if (n > RX_MAX_REPEAT) return -1;
+  }
+  return n;
+}
+
+struct rxNode *rxParseRepeat(struct rxParser *ps) {
+  struct rxNode *node = rxParseAtom(ps);
+  while (!ps->err && node) {
+    char c = *ps->p;
+    if (c == '*' || c == '+' || c == '?') {
+      ps->p++;
+      node = rxNew(c == '*' ? RX_STAR : c == '+' ? RX_PLUS : RX_QUEST, node, NULL);
+    } else if (c == '{') {
+      ps->p++;
+      int min = rxParseInt(ps), max = min;
+      if (*ps->p == ',') {
+        ps->p++;
+        max = (*ps->p == '}') ? -1 : rxParseInt(ps);
+        if (max < -1 || (max != -1 && max < min)) min = -1;
+      }
+      if (min < 0 || *ps->p != '}') {
+        ps->err = "bad repeat";
+        return node;
+      }
+      ps->p++;
+      node = rxNew(RX_REPEAT, node, NULL);
+      if (node) {
+        node->min = min;
+        node->max = max;
+      }
+    } else {
+      break;
+    }
+  }
+  return node;
+}
+
+struct rxNode *rxParseConcat(struct rxParser *ps) {
+  struct rxNode *node = NULL;
+  while (!ps->err && *ps->p && *ps->p != '|' && *ps->p != ')') {
+    struct rxNode *next = rxParseRepeat(ps);
+    node = node ? rxNew(RX_CAT, node, next) : next;
+  }
+  return node ? node : rxNew(RX_EMPTY, NULL, NULL);
+}
+
+struct rxNode *rxParseAlt(struct rxParser *ps) {
+  struct rxNode *node = rxParseConcat(ps);
+  while (!ps->err && *ps->p == '|') {
+    ps->p++;
+    node = rxNew(RX_ALT, node, rxParseConcat(ps));
+  }
+  return node;
+}
+
+/*** nfa ***/
+
+// NFA_BEGIN and NFA_END hold only at the start and end of the scan, which
+// for the reversed automaton are the end and start of the row
+enum nfaStateType {
+  NFA_SET,
+  NFA_EPS,
+  NFA_SPLIT,
+  NFA_BEGIN,
+  NFA_END,
+  NFA_MATCH
+};
+
+struct nfaState {
+  int type;
+  int out, out1;
+  unsigned char set[32];
+};
+
+struct nfa {
+  struct nfaState *s;
+  int n, cap;
+  int start;
+  int reverse;
+  int full;
+};
+
+// a piece of automaton with one way in and a dangling NFA_EPS way out
+struct nfaFrag {
+  int start, end;
+};
+
+int nfaAdd(struct nfa *nfa, int type) {
+  if (nfa->n == nfa->cap) {
+    if (nfa->cap >= RX_MAX_STATES) {
+      nfa->full = 1;
+      return 0;
+    }
+    int cap = nfa->cap ? nfa->cap * 2 : 64;
+    struct nfaState *s = realloc(nfa->s, sizeof(struct nfaState) * cap);
+    if (!s) {
+      nfa->full = 1;
+      return 0;
+    }
+    nfa->s = s;
+    nfa->cap = cap;
+  }
+  struct nfaState *st = &nfa->s[nfa->n];
+  memset(st, 0, sizeof(*st));
+  st->type = type;
+  st->out = st->out1 = -1;
+  return nfa->n++;
+}
+
+struct nfaFrag nfaCompile(struct nfa *nfa, struct rxNode *node) {
+  struct nfaFrag f, a, b;
+  if (nfa->full) {
+    f.start = f.end = 0;
+    return f;
+  }
+  switch (node->type) {
+    case RX_SET:
+      f.start = nfaAdd(nfa, NFA_SET);
+      f.end = nfaAdd(nfa, NFA_EPS);
+      memcpy(nfa->s[f.start].set, node->set, 32);
+      nfa->s[f.start].out = f.end;
+      break;
+    case RX_BOL:
+    case RX_EOL:
+      f.start = nfaAdd(nfa, (node->type == RX_BOL) != nfa->reverse ? NFA_BEGIN : NFA_END);
+      f.end = nfaAdd(nfa, NFA_EPS);
+      nfa->s[f.start].out = f.end;
+      break;
+    case RX_CAT:
+      // the reversed automaton reads the pieces back to front
+      a = nfaCompile(nfa, nfa->reverse ? node->b : node->a);
+      b = nfaCompile(nfa, nfa->reverse ? node->a : node->b);
+      nfa->s[a.end].out = b.start;
+      f.start = a.start;
+      f.end = b.end;
+      break;
+    case RX_ALT:
+      a = nfaCompile(nfa, node->a);
+      b = nfaCompile(nfa, node->b);
+      f.start = nfaAdd(nfa, NFA_SPLIT);
+      f.end = nfaAdd(nfa, NFA_EPS);
+      nfa->s[f.start].out = a.start;
+      nfa->s[f.start].out1 = b.start;
+      nfa->s[a.end].out = f.end;
+      nfa->s[b.end].out = f.end;
+      break;
+    case RX_STAR:
+    case RX_PLUS:
+    case RX_QUEST:
+      a = nfaCompile(nfa, node->a);
+      f.end = nfaAdd(nfa, NFA_EPS);
+      int split = nfaAdd(nfa, NFA_SPLIT);
+      nfa->s[split].out = a.start;
+      nfa->s[split].out1 = f.end;
+      nfa->s[a.end].out = (node->type == RX_QUEST) ? f.end : split;
+      f.start = (node->type == RX_PLUS) ? a.start : split;
+      break;
+    case RX_REPEAT: {
+      // x{2,4} is built as x x x? x?, x{2,} as x x x*
+      struct rxNode star = *node;
+      star.type = (node->max == -1) ? RX_STAR : RX_QUEST;
+      f.start = f.end = nfaAdd(nfa, NFA_EPS);
+      int copies = (node->max == -1) ? node->min + 1 : node->max;
+      for (int j = 0; j < copies && !nfa->full; j++) {
+        a = nfaCompile(nfa, j < node->min ? node->a : &star);
+        nfa->s[f.end].out = a.start;
+        f.end = a.end;
+      }
+      break;
+    }
+    default:
+      f.start = f.end = nfaAdd(nfa, NFA_EPS);
+      break;
+  }
+  return f;
+}
+
+int nfaBuild(struct nfa *nfa, struct rxNode *ast, int reverse) {
+  memset(nfa, 0, sizeof(*nfa));
+  nfa->reverse = reverse;
+  struct nfaFrag f = nfaCompile(nfa, ast);
+  int match = nfaAdd(nfa, NFA_MATCH);
+  if (nfa->full) return -1;
+  nfa->s[f.end].out = match;
+  nfa->start = f.start;
+  return 0;
+}
+
+/*** lazy dfa ***/
+
+struct dfaState {
+  int *set;                     // NFA states it stands for, sorted
+  int n;
+  unsigned hash;
+  int match;                    // a match ends before the next byte
+  int match_end;                // a match ends here if the text ends here
+  struct dfaState *next[256];   // NULL until first taken
+};
+
+struct dfa {
+  struct nfa *nfa;
+  int unanchored;               // a match may start at any byte
+  struct dfaState **states;
+  int n;
+  int *table;                   // open addressing, state index + 1
+  int tablecap;
+  struct dfaState *start[2];    // start state away from and at the begin
+  int *stack, *seeds, *buf;
+  unsigned *mark;
+  unsigned gen;
+};
+
+// returns -1, leaving d empty, when out of memory
+int dfaInit(struct dfa *d, struct nfa *nfa, int unanchored) {
+  memset(d, 0, sizeof(*d));
+  d->nfa = nfa;
+  d->unanchored = unanchored;
+  d->states = malloc(sizeof(struct dfaState *) * DFA_MAX_STATES);
+  d->tablecap = DFA_MAX_STATES * 2;
+  d->table = calloc(d->tablecap, sizeof(int));
+  d->stack = malloc(sizeof(int) * (nfa->n + 1));
+  d->seeds = malloc(sizeof(int) * (nfa->n + 1));
+  d->buf = malloc(sizeof(int) * (nfa->n + 1));
+  d->mark = calloc(nfa->n, sizeof(unsigned));
+  if (!d->states || !d->table || !d->stack || !d->seeds || !d->buf || !d->mark) {
+    free(d->states);
+    free(d->table);
+    free(d->stack);
+    free(d->seeds);
+    free(d->buf);
+    free(d->mark);
+    memset(d, 0, sizeof(*d));
+    return -1;
+  }
+  return 0;
+}
+
+void dfaFlush(struct dfa *d) {
+  for (int j = 0; j < d->n; j++) {
+    free(d->states[j]->set);
+    free(d->states[j]);
+  }
+  d->n = 0;
+  memset(d->table, 0, sizeof(int) * d->tablecap);
+  d->start[0] = d->start[1] = NULL;
+}
+
+void dfaFree(struct dfa *d) {
+  if (!d->states) return;
+  dfaFlush(d);
+  free(d->states);
+  free(d->table);
+  free(d->stack);
+  free(d->seeds);
+  free(d->buf);
+  free(d->mark);
+}
+
+int intCompare(const void *a, const void *b) {
+  return *(const int *) a - *(const int *) b;
+}
+
+// follow the empty moves out of seeds into d->buf, keeping only the states
+// that still matter: those reading a byte, NFA_END and NFA_MATCH
+int dfaClosure(struct dfa *d, int *seeds, int nseeds, int begin, int end) {
+  struct nfaState *s = d->nfa->s;
+  int sp = 0, n = 0;
+  if (++d->gen == 0) {
+    memset(d->mark, 0, sizeof(unsigned) * d->nfa->n);
+    d->gen = 1;
+  }
+  for (int j = 0; j < nseeds; j++) {
+    if (d->mark[seeds[j]] == d->gen) continue;
+    d->mark[seeds[j]] = d->gen;
+    d->stack[sp++] = seeds[j];
+  }
+  while (sp > 0) {
+    int id = d->stack[--sp];
+    int follow[2] = {-1, -1};
+    switch (s[id].type) {
+      case NFA_EPS:
+        follow[0] = s[id].out;
+        break;
+      case NFA_SPLIT:
+        follow[0] = s[id].out;
+        follow[1] = s[id].out1;
+        break;
+      case NFA_BEGIN:
+        if (begin) follow[0] = s[id].out;
+        break;
+      case NFA_END:
+        d->buf[n++] = id;
+        if (end) follow[0] = s[id].out;
+        break;
+      default:
+        d->buf[n++] = id;
+        break;
+    }
+    for (int k = 0; k < 2; k++) {
+      if (follow[k] < 0 || d->mark[follow[k]] == d->gen) continue;
+      d->mark[follow[k]] = d->gen;
+      d->stack[sp++] = follow[k];
+    }
+  }
+  qsort(d->buf, n, sizeof(int), intCompare);
+  return n;
+}
+
+// the state for the NFA set in d->buf, or -1 when the cache is full
+int dfaIntern(struct dfa *d, int n) {
+  unsigned hash = 2166136261u;
+  for (int j = 0; j < n; j++) hash = (hash ^ d->buf[j]) * 16777619u;
+  unsigned slot = hash % d->tablecap;
+  while (d->table[slot]) {
+    struct dfaState *st = d->states[d->table[slot] - 1];
+    if (st->hash == hash && st->n == n &&
+        memcmp(st->set, d->buf, sizeof(int) * n) == 0)
+      return d->table[slot] - 1;
+    slot = (slot + 1) % d->tablecap;
+  }
+  if (d->n == DFA_MAX_STATES) return -1;
+
+  struct dfaState *st = malloc(sizeof(struct dfaState));
+  if (!st) return -1;
+  st->set = malloc(sizeof(int) * (n ? n : 1));
+  if (!st->set) {
+    free(st);
+    return -1;
+  }
+  memcpy(st->set, d->buf, sizeof(int) * n);
+  st->n = n;
+  st->hash = hash;
+  st->match = 0;
+  for (int j = 0; j < n; j++)
+    if (d->nfa->s[st->set[j]].type == NFA_MATCH) st->match = 1;
+  memset(st->next, 0, sizeof(st->next));
+  d->table[slot] = d->n + 1;
+  d->states[d->n] = st;
+
+  int m = dfaClosure(d, st->set, n, 0, 1);
+  st->match_end = 0;
+  for (int j = 0; j < m; j++)
+    if (d->nfa->s[d->buf[j]].type == NFA_MATCH) st->match_end = 1;
+  return d->n++;
+}
+
+// intern d->buf, starting the cache over if it has filled up; with the
+// cache empty only memory can run out
+struct dfaState *dfaInternOrFlush(struct dfa *d, int n) {
+  int id = dfaIntern(d, n);
+  if (id == -1) {
+    dfaFlush(d);
+    id = dfaIntern(d, n);
+    if (id == -1) die("malloc");
+  }
+  return d->states[id];
+}
+
+struct dfaState *dfaStart(struct dfa *d, int begin) {
+  if (!d->start[begin]) {
+    int seed = d->nfa->start;
+    int n = dfaClosure(d, &seed, 1, begin, 0);
+    struct dfaState *st = dfaInternOrFlush(d, n);
+    d->start[begin] = st;
+  }
+  return d->start[begin];
+}
+
+// work out a transition not taken before; callers go through DFA_NEXT
+struct dfaState *dfaStep(struct dfa *d, struct dfaState *st, unsigned char c) {
+  struct nfaState *s = d->nfa->s;
+  int nseeds = 0;
+  for (int j = 0; j < st->n; j++) {
+    struct nfaState *ns = &s[st->set[j]];
+    if (ns->type == NFA_SET && SET_HAS(ns->set, c)) d->seeds[nseeds++] = ns->out;
+  }
+  if (d->unanchored) d->seeds[nseeds++] = d->nfa->start;
+  int n = dfaClosure(d, d->seeds, nseeds, 0, 0);
+  int next = dfaIntern(d, n);
+  if (next == -1) {
+    // st goes away with the rest of the cache; the caller only needs next
+    return dfaInternOrFlush(d, n);
+  }
+  st->next[c] = d->states[next];
+  return st->next[c];
+}
+
+#define DFA_NEXT(d, st, c) ((st)->next[c] ? (st)->next[c] : dfaStep(d, st, c))
+
+/*** matching ***/
+
+struct regex {
+  struct nfa fwd_nfa, rev_nfa;
+  struct dfa fwd;               // unanchored, answers whether a row matches
+  struct dfa rev;               // unanchored over the reversed row
+  struct dfa anchored;          // measures a match from a known start
+};
+
+struct regex *regexCompile(const char *pattern, const char **err) {
+  struct rxParser ps = {pattern, NULL};
+  struct rxNode *ast = rxParseAlt(&ps);
+  if (!ps.err && *ps.p) ps.err = "unmatched )";
+  if (!ps.err && !ast) ps.err = "out of memory";
+  struct regex *re = NULL;
+  if (!ps.err) {
+    re = calloc(1, sizeof(struct regex));
+    if (!re || nfaBuild(&re->fwd_nfa, ast, 0) == -1 ||
+        nfaBuild(&re->rev_nfa, ast, 1) == -1) {
+      ps.err = "pattern too large";
+      regexFree(re);
+      re = NULL;
+    }
+  }
+  rxFreeNode(ast);
+  if (err) *err = ps.err;
+  if (!re) return NULL;
+  if (dfaInit(&re->fwd, &re->fwd_nfa, 1) == -1 ||
+      dfaInit(&re->rev, &re->rev_nfa, 1) == -1 ||
+      dfaInit(&re->anchored, &re->fwd_nfa, 0) == -1) {
+    if (err) *err = "out of memory";
+    regexFree(re);
+    return NULL;
+  }
+  return re;
+}
+
+void regexFree(struct regex *re) {
+  if (!re) return;
+  dfaFree(&re->fwd);
+  dfaFree(&re->rev);
+  dfaFree(&re->anchored);
+  free(re->fwd_nfa.s);
+  free(re->rev_nfa.s);
+  free(re);
+}
+
+// find the leftmost-longest match in text: a forward pass tells whether
+// there is one at all, a backward pass finds its leftmost start and an
+// anchored forward pass from there finds its longest end
+int regexSearch(struct regex *re, const char *text, int len, int *start, int *end) {
+  const unsigned char *t = (const unsigned char *) text;
+  struct dfa *d = &re->fwd;
+  struct dfaState *st = dfaStart(d, 1);
+  int i;
+  for (i = 0; i < len && !st->match; i++) st = DFA_NEXT(d, st, t[i]);
+  if (!st->match && !st->match_end) return 0;
+
+  d = &re->rev;
+  st = dfaStart(d, 1);
+  int left = st->match ? len : -1;
+  for (i = len - 1; i >= 0; i--) {
+    st = DFA_NEXT(d, st, t[i]);
+    if (st->match) left = i;
+  }
+  if (st->match_end) left = 0;
+  if (left == -1) return 0;
+
+  d = &re->anchored;
+  st = dfaStart(d, left == 0);
+  int right = st->match ? left : -1;
+  for (i = left; i < len && st->n > 0; i++) {
+    st = DFA_NEXT(d, st, t[i]);
+    if (st->match) right = i + 1;
+  }
+  if (i == len && st->match_end) right = len;
+  if (right == -1) return 0;
+
+  *start = left;
+  *end = right;
+  return 1;
+}
@@ -0,0 +1,559 @@
+// syntax highlighting: each language is compiled once into a byte class
+// table, a keyword trie and its delimiters, and a line is then lexed by a
+// small state machine (code, string, block comment) that only stops on
+// bytes its table marks as interesting. Plain runs inside strings and
+// block comments are skipped 16 bytes at a time where SSE2 is available.
+//
+// C is built in; more languages are read from syntax files, see
+// syntaxLoadFile for the format.
+
+#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "zuma.h"
+
+#define HL_HIGHLIGHT_NUMBERS (1<<0)
+#define HL_HIGHLIGHT_STRINGS (1<<1)
+
+#define SYNTAX_SEPARATORS ",.()+-/*=~%<>[];"
+#define SYNTAX_QUOTES "\"'"
+
+// keywords compiled into a trie over the bytes they use, so matching one
+// costs a step per byte of text whatever the length of the list
+struct keywordTrie {
+  unsigned char col[256];         // byte -> column + 1, 0 if in no keyword
+  int ncols;
+  int nodes, cap;
+  int *next;                      // nodes x ncols, 0 for no edge
+  unsigned char *cls;             // keyword class ending here, or HL_NORMAL
+  int *rank;                      // its place in the list, earlier wins
+};
+
+// what the lexer has to look at a byte for, outside strings and comments
+#define LX_SEP (1<<0)             // ends a word
+#define LX_DIGIT (1<<1)           // may start or continue a number
+#define LX_QUOTE (1<<2)           // opens a string
+#define LX_LINE (1<<3)            // first byte of the line comment marker
+#define LX_BLOCK (1<<4)           // first byte of the block comment marker
+#define LX_WORD (1<<5)            // first byte of some keyword
+
+struct lexer {
+  unsigned char cls[256];
+  struct keywordTrie *trie;
+  const char *scs, *mcs, *mce;
+  int scs_len, mcs_len, mce_len;
+  int reach;                      // how far past a byte classing it may look
+};
+
+struct editorSyntax {
+  char *filetype;
+  char **filematch;
+  char **keywords;
+  char *singleline_comment_start;
+  char *multiline_comment_start;
+  char *multiline_comment_end;
+  int flags;
+  char *separators;               // NULL for SYNTAX_SEPARATORS
+  char *quotes;                   // NULL for SYNTAX_QUOTES
+  struct lexer *lx;               // built on first use
+  struct editorSyntax *next;      // loaded syntaxes, checked before HLDB
+};
+
+/*** filetypes ***/
+char *C_HL_extensions[] = { ".c", ".h", ".cpp", NULL };
+char *C_HL_keywords[] = {
+  "switch", "if", "while", "for", "break", "continue", "return", "else",
+  "struct", "union", "typedef", "static", "enum", "class", "case",
+  "int|", "long|", "double|", "float|", "char|", "unsigned|", "signed|",
+  "void|", NULL
+};
+struct editorSyntax HLDB[] = {
+  {
+    "c",
+    C_HL_extensions,
+    C_HL_keywords,
+    "//", "/*", "*/",
+    HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+    NULL, NULL, NULL, NULL
+  },
+};
+#define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
+
+struct editorSyntax *loaded = NULL;
+
+/*** keywords ***/
+
+int keywordTrieNode(struct keywordTrie *t) {
+  if (t->nodes == t->cap) {
+    t->cap = t->cap ? t->cap * 2 : 64;
+    t->next = realloc(t->next, sizeof(int) * t->cap * t->ncols);
+    t->cls = realloc(t->cls, t->cap);
+    t->rank = realloc(t->rank, sizeof(int) * t->cap);
+    if (!t->next || !t->cls || !t->rank) die("realloc");
+  }
+  memset(&t->next[t->nodes * t->ncols], 0, sizeof(int) * t->ncols);
+  t->cls[t->nodes] = HL_NORMAL;
+  t->rank[t->nodes] = 0;
+  return t->nodes++;
+}
+
+// a trailing | marks a type keyword, which gets HL_KEYWORD2
+struct keywordTrie *keywordCompile(char **keywords) {
+  struct keywordTrie *t = calloc(1, sizeof(struct keywordTrie));
+  if (!t) die("calloc");
+  int j;
+  for (j = 0; keywords[j]; j++) {
+    for (char *p = keywords[j]; *p; p++) {
+      unsigned char c = *p;
+      if (!t->col[c]) t->col[c] = ++t->ncols;
+    }
+  }
+  if (t->ncols == 0) t->ncols = 1;
+  keywordTrieNode(t);
+  for (j = 0; keywords[j]; j++) {
+    int klen = strlen(keywords[j]);
+    int kw2 = klen > 0 && keywords[j][klen - 1] == '|';
+    if (kw2) klen--;
+    if (klen == 0) continue;
+    int node = 0;
+    for (int k = 0; k < klen; k++) {
+      int edge = node * t->ncols + t->col[(unsigned char) keywords[j][k]] - 1;
+      if (!t->next[edge]) {
+        int child = keywordTrieNode(t);
+        t->next[edge] = child;
+      }
+      node = t->next[edge];
+    }
+    if (t->cls[node] == HL_NORMAL) {
+      t->cls[node] = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+      t->rank[node] = j;
+    }
+  }
+  return t;
+}
+
+// the keyword text starts with, if one is followed by a separator; when
+// several are, the one listed first wins, as it did with a plain scan
+int keywordMatch(struct lexer *lx, const char *text, int len, int *cls) {
+  struct keywordTrie *t = lx->trie;
+  int node = 0, best = 0, best_rank = -1;
+  for (int j = 0; j < len; j++) {
+    int col = t->col[(unsigned char) text[j]];
+    if (!col || !(node = t->next[node * t->ncols + col - 1])) break;
+    if (t->cls[node] != HL_NORMAL &&
+        (best_rank == -1 || t->rank[node] < best_rank) &&
+        (j + 1 == len || (lx->cls[(unsigned char) text[j + 1]] & LX_SEP))) {
+      best = j + 1;
+      best_rank = t->rank[node];
+      *cls = t->cls[node];
+    }
+  }
+  return best;
+}
+
+/*** lexer ***/
+
+struct lexer *lexerCompile(struct editorSyntax *s) {
+  struct lexer *lx = calloc(1, sizeof(struct lexer));
+  if (!lx) die("calloc");
+  const char *sep = s->separators ? s->separators : SYNTAX_SEPARATORS;
+  for (int c = 0; c < 256; c++) {
+    if (isspace(c) || c == '\0' || strchr(sep, c)) lx->cls[c] |= LX_SEP;
+    if ((s->flags & HL_HIGHLIGHT_NUMBERS) && (isdigit(c) || c == '.'))
+      lx->cls[c] |= LX_DIGIT;
+  }
+  if (s->flags & HL_HIGHLIGHT_STRINGS) {
+    for (const char *q = s->quotes ? s->quotes : SYNTAX_QUOTES; *q; q++)
+      lx->cls[(unsigned char) *q] |= LX_QUOTE;
+  }
+  lx->scs = s->singleline_comment_start;
+  lx->scs_len = lx->scs ? strlen(lx->scs) : 0;
+  if (lx->scs_len) lx->cls[(unsigned char) lx->scs[0]] |= LX_LINE;
+  // a block comment needs both of its markers to count
+  if (s->multiline_comment_start && s->multiline_comment_end &&
+      s->multiline_comment_start[0] && s->multiline_comment_end[0]) {
+    lx->mcs = s->multiline_comment_start;
+    lx->mce = s->multiline_comment_end;
+    lx->mcs_len = strlen(lx->mcs);
+    lx->mce_len = strlen(lx->mce);
+    lx->cls[(unsigned char) lx->mcs[0]] |= LX_BLOCK;
+  }
+  lx->trie = keywordCompile(s->keywords);
+  // a keyword is looked at whole plus the separator after it
+  lx->reach = lx->scs_len;
+  if (lx->mcs_len > lx->reach) lx->reach = lx->mcs_len;
+  if (lx->mce_len > lx->reach) lx->reach = lx->mce_len;
+  for (char **k = s->keywords; *k; k++)
+    if ((int) strlen(*k) + 1 > lx->reach) lx->reach = strlen(*k) + 1;
+  for (int c = 0; c < 256; c++) if (lx->trie->col[c]) lx->cls[c] |= LX_WORD;
+  return lx;
+}
+
+// index of the first a or b at or after i, or len
+int lexSkipTo(const char *text, int i, int len, char a, char b) {
+#ifdef __SSE2__
+  __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b);
+  for (; len - i >= 16; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (text + i));
+    unsigned mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, va),
+                                                   _mm_cmpeq_epi8(v, vb)));
+    if (mask) return i + __builtin_ctz(mask);
+  }
+#endif
+  while (i < len && text[i] != a && text[i] != b) i++;
+  return i;
+}
+
+// class the bytes of text from i up to end, those before lim at least,
+// lim being where the caller's hl ends
+void lexMark(unsigned char *hl, int i, int end, int lim, int cls) {
+  if (end > lim) end = lim;
+  if (end > i) memset(&hl[i], cls, end - i);
+}
+
+// carry a string on from i to just past its closing quote, clearing
+// *quote, or stop at lim, or just past it if an escape straddles it. A
+// backslash escapes the next byte; strings end with their line
+int lexString(const char *text, int i, int len, int lim, unsigned char *hl,
+              int *quote) {
+  char q = *quote;
+  while (i < lim) {
+    int end = lexSkipTo(text, i, lim, q, '\\');
+    if (end < lim && text[end] == q) {
+      memset(&hl[i], HL_STRING, end + 1 - i);
+      *quote = 0;
+      return end + 1;
+    }
+    if (end >= len - 1) {
+      lexMark(hl, i, len, lim, HL_STRING);
+      *quote = 0;
+      return len;
+    }
+    if (end == lim) {
+      memset(&hl[i], HL_STRING, lim - i);
+      return lim;
+    }
+    lexMark(hl, i, end + 2, lim, HL_STRING);
+    i = end + 2;
+  }
+  if (i >= len) *quote = 0;
+  return i;
+}
+
+// lex text from where st left off until the first token boundary at or
+// past to, classing the bytes before to into hl; returns where it stopped.
+// Every stretch the lexer can skip over in one go is cut at to, so it
+// never stops more than a keyword or a marker past it.
+int lexRun(struct lexer *lx, const char *text, int len, int to,
+           unsigned char *hl, struct lexState *st) {
+  const unsigned char *cls = lx->cls;
+  int in_comment = lx->mce ? st->in_comment : 0;
+  int prev_sep = st->prev_sep;
+  int quote = st->quote;
+  int i = 0;
+
+  if (st->line_comment) {
+    lexMark(hl, 0, to, to, HL_COMMENT);
+    return to;
+  }
+  if (quote) {
+    i = lexString(text, i, len, to, hl, &quote);
+    prev_sep = 1;
+  }
+  while (i < to) {
+    if (in_comment) {
+      int end = lexSkipTo(text, i, to, lx->mce[0], lx->mce[0]);
+      while (end < to && (len - end < lx->mce_len ||
+                          memcmp(&text[end], lx->mce, lx->mce_len)))
+        end = lexSkipTo(text, end + 1, to, lx->mce[0], lx->mce[0]);
+      if (end == to) {
+        lexMark(hl, i, to, to, HL_MLCOMMENT);
+        i = to;
+        break;
+      }
+      lexMark(hl, i, end + lx->mce_len, to, HL_MLCOMMENT);
+      i = end + lx->mce_len;
+      in_comment = 0;
+      prev_sep = 1;
+      continue;
+    }
+
+    unsigned char c = text[i];
+    unsigned char k = cls[c];
+    if (k == 0) {
+      while (++i < to && cls[(unsigned char) text[i]] == 0);
+      prev_sep = 0;
+      continue;
+    }
+
+    if ((k & LX_LINE) && len - i >= lx->scs_len &&
+        !memcmp(&text[i], lx->scs, lx->scs_len)) {
+      lexMark(hl, i, to, to, HL_COMMENT);
+      st->line_comment = 1;
+      i = to;
+      break;
+    }
+
+    if ((k & LX_BLOCK) && len - i >= lx->mcs_len &&
+        !memcmp(&text[i], lx->mcs, lx->mcs_len)) {
+      lexMark(hl, i, i + lx->mcs_len, to, HL_MLCOMMENT);
+      i += lx->mcs_len;
+      in_comment = 1;
+      continue;
+    }
+
+    if (k & LX_QUOTE) {
+      hl[i++] = HL_STRING;
+      quote = c;
+      i = lexString(text, i, len, to, hl, &quote);
+      prev_sep = 1;
+      continue;
+    }
+
+    if (k & LX_DIGIT) {
+      int prev_number = i > 0 ? hl[i - 1] == HL_NUMBER : st->prev_number;
+      if ((c != '.' && (prev_sep || prev_number)) || (c == '.' && prev_number)) {
+        hl[i++] = HL_NUMBER;
+        prev_sep = 0;
+        continue;
+      }
+    }
+
+    if (prev_sep && (k & LX_WORD)) {
+      int kcls;
+      int klen = keywordMatch(lx, &text[i], len - i, &kcls);
+      if (klen) {
+        lexMark(hl, i, i + klen, to, kcls);
+        i += klen;
+        prev_sep = 0;
+        continue;
+      }
+    }
+
+    prev_sep = k & LX_SEP;
+    i++;
+  }
+  st->in_comment = in_comment;
+  st->prev_sep = prev_sep;
+  if (i > 0) st->prev_number = i <= to && hl[i - 1] == HL_NUMBER;
+  st->quote = quote;
+  return i;
+}
+
+// lex text[from..to) of a line carrying on in state st, with hl[0] taking
+// the class of text[from]; see lexRun
+int syntaxLexFrom(struct editorSyntax *s, const char *text, int len, int from,
+                  int to, unsigned char *hl, struct lexState *st) {
+  if (to > len) to = len;
+  memset(hl, HL_NORMAL, to - from);
+  if (!s) {
+    st->in_comment = 0;
+    return to;
+  }
+  if (!s->lx) s->lx = lexerCompile(s);
+  return from + lexRun(s->lx, text + from, len - from, to - from, hl, st);
+}
+
+int syntaxHighlightLine(struct editorSyntax *s, const char *text, int len,
+                        unsigned char *hl, int in_comment) {
+  struct lexState st = { in_comment, 1, 0, 0, 0 };
+  syntaxLexFrom(s, text, len, 0, len, hl, &st);
+  return st.in_comment;
+}
+
+/*** syntax files ***/
+
+// a syntax file holds sections like
+//
+//   [python]
+//   match = .py .pyw SConstruct
+//   comment = #
+//   block = /* */
+//   strings = "'`
+//   separators = ,.()+-/*=~%<>[];:{}
+//   numbers = yes
+//   keywords = def class if elif else return
+//   types = int str float bool
+//
+// match entries starting with . are extensions, others are looked for
+// anywhere in the file name. Lines starting with # are comments.
+
+char *syntaxTrim(char *s) {
+  while (isspace((unsigned char) *s)) s++;
+  char *end = s + strlen(s);
+  while (end > s && isspace((unsigned char) end[-1])) *--end = '\0';
+  return s;
+}
+
+// append the words of value to a NULL terminated list, each followed by
+// suffix; returns the new list
+char **syntaxAddWords(char **list, const char *value, const char *suffix) {
+  int n = 0;
+  while (list && list[n]) n++;
+  char *copy = strdup(value);
+  if (!copy) die("strdup");
+  for (char *w = strtok(copy, " \t"); w; w = strtok(NULL, " \t")) {
+    list = realloc(list, sizeof(char *) * (n + 2));
+    if (!list) die("realloc");
+    list[n] = malloc(strlen(w) + strlen(suffix) + 1);
+    if (!list[n]) die("malloc");
+    sprintf(list[n], "%s%s", w, suffix);
+    list[++n] = NULL;
+  }
+  free(copy);
+  return list;
+}
+
+char *syntaxDupOrNull(const char *value) {
+  if (!*value) return NULL;
+  char *s = strdup(value);
+  if (!s) die("strdup");
+  return s;
+}
+
+int syntaxSetKey(struct editorSyntax *s, const char *key, char *value) {
+  if (!strcmp(key, "match")) {
+    s->filematch = syntaxAddWords(s->filematch, value, "");
+  } else if (!strcmp(key, "keywords")) {
+    s->keywords = syntaxAddWords(s->keywords, value, "");
+  } else if (!strcmp(key, "types")) {
+    s->keywords = syntaxAddWords(s->keywords, value, "|");
+  } else if (!strcmp(key, "comment")) {
+    free(s->singleline_comment_start);
+    s->singleline_comment_start = syntaxDupOrNull(value);
+  } else if (!strcmp(key, "block")) {
+    char *end = value + strcspn(value, " \t");
+    if (!*end) return -1;
+    *end++ = '\0';
+    free(s->multiline_comment_start);
+    free(s->multiline_comment_end);
+    s->multiline_comment_start = syntaxDupOrNull(value);
+    s->multiline_comment_end = syntaxDupOrNull(syntaxTrim(end));
+  } else if (!strcmp(key, "strings")) {
+    free(s->quotes);
+    s->quotes = syntaxDupOrNull(value);
+    if (s->quotes) s->flags |= HL_HIGHLIGHT_STRINGS;
+    else s->flags &= ~HL_HIGHLIGHT_STRINGS;
+  } else if (!strcmp(key, "separators")) {
+    free(s->separators);
+    s->separators = strdup(value);
+    if (!s->separators) die("strdup");
+  } else if (!strcmp(key, "numbers")) {
+    if (!strcmp(value, "yes")) s->flags |= HL_HIGHLIGHT_NUMBERS;
+    else if (!strcmp(value, "no")) s->flags &= ~HL_HIGHLIGHT_NUMBERS;
+    else return -1;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+struct editorSyntax *syntaxNew(const char *name) {
+  struct editorSyntax *s = calloc(1, sizeof(struct editorSyntax));
+  if (!s) die("calloc");
+  s->filetype = strdup(name);
+  s->filematch = calloc(1, sizeof(char *));
+  s->keywords = calloc(1, sizeof(char *));
+  if (!s->filetype || !s->filematch || !s->keywords) die("malloc");
+  return s;
+}
+
+// read the syntaxes defined in path, later ones taking precedence over
+// earlier ones and over the built in C; returns -1 with *err and *errline
+// set if the file can't be read or a line makes no sense
+int syntaxLoadFile(const char *path, const char **err, int *errline) {
+  FILE *fp = fopen(path, "r");
+  if (!fp) {
+    *err = "can't open";
+    *errline = 0;
+    return -1;
+  }
+  struct editorSyntax *s = NULL;
+  char *line = NULL;
+  size_t linecap = 0;
+  int lineno = 0, ret = 0;
+  while (getline(&line, &linecap, fp) != -1) {
+    lineno++;
+    char *p = syntaxTrim(line);
+    if (*p == '\0' || *p == '#') continue;
+    if (*p == '[') {
+      char *end = strchr(p, ']');
+      if (!end || end == p + 1) {
+        *err = "bad section name";
+        ret = -1;
+        break;
+      }
+      *end = '\0';
+      s = syntaxNew(syntaxTrim(p + 1));
+      s->next = loaded;
+      loaded = s;
+      continue;
+    }
+    char *eq = strchr(p, '=');
+    if (!s || !eq) {
+      *err = s ? "expected key = value" : "expected [name]";
+      ret = -1;
+      break;
+    }
+    *eq = '\0';
+    if (syntaxSetKey(s, syntaxTrim(p), syntaxTrim(eq + 1)) == -1) {
+      *err = "unknown key or bad value";
+      ret = -1;
+      break;
+    }
+  }
+  free(line);
+  fclose(fp);
+  *errline = lineno;
+  return ret;
+}
+
+/*** selection ***/
+
+int syntaxMatches(struct editorSyntax *s, const char *filename, const char *ext) {
+  for (unsigned int i = 0; s->filematch[i]; i++) {
+    int is_ext = (s->filematch[i][0] == '.');
+    if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
+        (!is_ext && strstr(filename, s->filematch[i])))
+      return 1;
+  }
+  return 0;
+}
+
+struct editorSyntax *syntaxSelect(const char *filename) {
+  if (filename == NULL) return NULL;
+  char *ext = strrchr(filename, '.');
+  struct editorSyntax *s;
+  for (s = loaded; s; s = s->next)
+    if (syntaxMatches(s, filename, ext)) break;
+  for (unsigned int j = 0; !s && j < HLDB_ENTRIES; j++)
+    if (syntaxMatches(&HLDB[j], filename, ext)) s = &HLDB[j];
+  if (s && !s->lx) s->lx = lexerCompile(s);
+  return s;
+}
+
+const char *syntaxName(struct editorSyntax *s) {
+  return s->filetype;
+}
+
+// block comments make a row's colors depend on the rows above it
+int syntaxIsStateful(struct editorSyntax *s) {
+  if (!s) return 0;
+  if (!s->lx) s->lx = lexerCompile(s);
+  return s->lx->mce != NULL;
+}
+
+// how many bytes past where it stops the lexer may have looked, so how far
+// back an edit can change the state it stopped in
+int syntaxReach(struct editorSyntax *s) {
+  if (!s) return 0;
+  if (!s->lx) s->lx = lexerCompile(s);
+  return s->lx->reach;
+}
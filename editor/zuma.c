@@ -13,7 +13,18 @@
 #include <time.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <stdarg.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <limits.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "zuma.h"
 
 
@@ -24,6 +35,9 @@
 
 #define ZUMA_TAB_STOP 4
 
+// rows highlighted ahead of the viewport per slice of idle time
+#define HL_IDLE_SLICE 4096
+
 enum editorKey {
   BACKSPACE = 127,
   ARROW_LEFT = 1000,
@@ -34,42 +48,211 @@ enum editorKey {
   HOME_KEY,
   END_KEY,
   PAGE_UP,
-  PAGE_DOWN
-};
-
-enum editorHighlight {
-  HL_NORMAL = 0,
-  HL_COMMENT,
-  HL_MLCOMMENT,
-  HL_KEYWORD1,
-  HL_KEYWORD2,
-  HL_STRING,
-  HL_NUMBER,
-  HL_MATCH
+  PAGE_DOWN,
+  PASTE                           // bracketed paste, text in input.paste
 };
 
-
-#define HL_HIGHLIGHT_NUMBERS (1<<0)
-#define HL_HIGHLIGHT_STRINGS (1<<1)
+// chars points into the file mapping, or text read at open, and must be
+// copied before editing
+#define ROW_MAPPED (1<<0)
+// render or the highlight state no longer match chars
+#define ROW_RENDER_STALE (1<<1)
+#define ROW_HL_STALE (1<<2)
+// chars may be read by a save or a task running on another thread, see
+// snapshots
+#define ROW_SHARED (1<<3)
+// render is chars itself, there being no tabs to expand
+#define ROW_RENDER_ALIAS (1<<4)
+// allocated with room for a small row's text after it, see inl
+#define ROW_INLINE (1<<5)
+// too long to render or highlight whole, see long rows
+#define ROW_LONG (1<<6)
+
+// rows are kept lean: text from the file stays in the mapping, a small
+// row's text lives right after it, render is only a copy when tabs make
+// it differ from chars, and render and hl are only kept for rows on screen
+#define ROW_INLINE_MAX 48              // fills the row's size class, see heapAlloc
 
 struct editorRow {
-  int index;
   int size;
   int rsize;
-  char* chars;
-  char* render;
-  unsigned char *hl;
-  int hl_open_comment;
+  int cap;                        // room in chars, 0 while they aren't ours
+  int flags;
+  int hl_gen;
+  unsigned char hl_in;            // comment state the row was highlighted from
+  unsigned char hl_open_comment;
+  char *chars;
+  char *render;
+  unsigned char *hl;              // NULL when only the state above is kept
+  char inl[];
 };
 
-struct editorSyntax {
-  char *filetype;
-  char **filematch;
-  char **keywords;
-  char *singleline_comment_start;
-  char *multiline_comment_start;
-  char *multiline_comment_end;
-  int flags;
+// a read-only view of the opened file plus where each of its lines starts;
+// lines[nlines] is one past the newline ending the last line
+struct editorMap {
+  char *data;
+  size_t len;
+  size_t *lines;
+  int nlines;
+};
+
+// what one frame shows: a character and an attribute byte per cell, the
+// attribute being an editorHighlight class plus ATTR_REVERSE
+#define ATTR_REVERSE 0x80
+
+struct screenBuffer {
+  int rows, cols;
+  char *chars;
+  unsigned char *attrs;
+};
+
+// the rows holding the current query, found in one pass and then stepped
+// through; only the first hit in each row counts, columns index chars
+struct searchMatch {
+  int row;
+  int col;
+  int len;
+};
+
+struct editorSearch {
+  char *query;
+  int qlen;
+  int regex;                      // query is a pattern for re
+  struct regex *re;
+  struct searchMatch *matches;
+  int nmatches, cap;
+  int current;                    // match jumped to, -1 before the first
+  struct searchJob *job;          // scan still running on the task pool
+  int hl_row, hl_col, hl_len;     // drawn as HL_MATCH, hl_row -1 for none
+};
+
+// state of the trigram filters kept on rope leaves, see search index
+struct editorIndex {
+  int enabled;
+  int bits_per_byte;
+  size_t text;                    // bytes in the buffer when opened
+  size_t bytes, cap;              // filter memory in use and allowed
+  int capped;
+  int build_row;                  // where the builder resumes, -1 when done
+  struct indexJob *job;           // leaves being filtered on the task pool
+  int reported;
+};
+
+// a stretch of text to write, always followed by a newline
+struct saveSpan {
+  const char *p;
+  size_t len;
+};
+
+// a save in progress: the snapshot of the buffer the writer thread is
+// streaming out, and the row text it may still be reading
+struct saveJob {
+  int running;
+  int done;                       // set by the writer once it has finished
+  int err;                        // errno of a failed save
+  pthread_t thread;
+  char *path;
+  mode_t mode;
+  struct saveSpan *spans;
+  size_t nspans, cap, bytes;
+  int dirty;                      // conf.dirty when the snapshot was taken
+  off_t journal_off;              // journal records made after the snapshot
+};
+
+// row text other threads may be reading: rows handed to one copy their
+// chars before changing them, and what they drop is kept here until the
+// last reader is done
+struct shareOrphan {
+  void *p;
+  size_t n;                       // as allocated, see heapFree
+};
+
+struct editorShare {
+  int readers;
+  struct shareOrphan *orphans;
+  int norphans, cap;
+};
+
+// row structs and their chars, render and hl, see row storage
+#define HEAP_CLASSES 24
+
+struct rowHeap {
+  void *free[HEAP_CLASSES];       // freed blocks, linked through their first word
+  char *bump, *end;               // what is left of the newest slab
+  char *text, *text_end;          // same for text read at open, never freed
+  unsigned long allocs, frees, reused, large;
+  size_t slab_bytes, text_bytes, live_bytes;
+};
+
+// a point of a long row where lexing can pick up: its screen column, the
+// lexer state there and whether a tab comes before the next mark
+struct longMark {
+  int at, rx;
+  struct lexState st;
+  unsigned char tabs;
+};
+
+struct longRow {
+  struct editorRow *row;
+  struct longMark *marks;         // marks[0] is at 0
+  int n, cap;
+  int size;                       // of the row the marks are for
+  int rsize;                      // screen columns of the whole row
+  int out;                        // comment state at the end
+  int dirty;                      // marks from here on need lexing, n if none
+  int edited;                     // marks before this saw the text after them change
+  int in, gen;                    // comment state and syntax lexed for
+};
+
+// long rows by row, open addressing
+struct longTable {
+  struct longRow **slots;
+  int cap, n;
+};
+
+enum undoType {
+  U_INSERT = 1,                   // text went into a row
+  U_DELETE,                       // text came out of a row
+  U_INSERT_ROW,
+  U_DELETE_ROW
+};
+
+// the edit journal kept next to the file, see journal
+enum journalOp {
+  J_INSERT_CHAR = 1,
+  J_DELETE_CHAR,
+  J_INSERT_ROW,
+  J_DELETE_ROW,
+  J_APPEND,
+  J_TRUNCATE,
+  J_INSERT_TEXT,
+  J_DELETE_TEXT
+};
+
+struct editorJournal {
+  int enabled;                    // edits are being recorded
+  int fd;                         // -1 until there is something to keep
+  char *path;
+  struct stat base;               // the file the records apply to
+  off_t size;                     // bytes of the journal on disk
+  char *buf;                      // records not written yet
+  size_t len, cap;
+};
+
+// a headless run from a recorded script, see replay
+struct editorReplay {
+  char *keys;                     // the script, NULL when not replaying
+  size_t len, pos;
+  int rows, cols;                 // the virtual screen
+  char *out;                      // everything written, in place of the terminal
+  size_t out_len, out_cap;
+  int timing;                     // a key is being handled
+  struct timespec start;          // when it was read
+  unsigned long allocs;           // row storage allocations at that point
+  unsigned long long *ns;         // what each key took
+  int nkeys, cap;
+  unsigned long key_allocs;
+  FILE *record;                   // ZUMA_RECORD, typed keys are saved here
 };
 
 struct editorConfig {
@@ -78,38 +261,62 @@ struct editorConfig {
   int rowoff, coloff;
   int screenrows, screencols;
   int nrows;
-  struct editorRow* row;
+  struct ropeNode *rope;
+  struct editorMap map;
   char *filename;
   int dirty;
   char statusmsg[80];
   time_t statusmsg_time;
+  time_t edit_time;             // of the last key that changed the buffer
+  int autosave;                 // seconds of quiet before saving, 0 for never
   struct editorSyntax *syntax;
+  struct editorSearch search;
+  struct editorIndex index;
+  struct saveJob save;
+  struct editorShare share;
+  struct rowHeap heap;
+  struct longTable longrows;
+  struct editorReplay replay;
+  struct editorJournal journal;
+  unsigned version;   // bumped by every edit, tells tasks their snapshot is old
+  int hl_gen;         // bumped whenever the syntax changes
+  int hl_frontier;    // rows above this have an up to date highlight state
+  struct hlJob *hl_job;         // highlighting ahead on the task pool
+  struct screenBuffer frame;    // being composed
+  struct screenBuffer screen;   // what the terminal shows now
+  int screen_valid;
+  int screen_rowoff;            // rowoff the terminal's text rows are from
+  int drawn_off, drawn_rows;    // rows on screen last frame, see editorDrawRows
+  unsigned long frames, frame_bytes, total_frame_bytes;
+  int hl_stats;
+  unsigned long long hl_bytes, hl_ns;
   struct termios orig_termios;
 } conf;
 
 
-/*** filetypes ***/
-char *C_HL_extensions[] = { ".c", ".h", ".cpp", NULL };
-char *C_HL_keywords[] = {
-  "switch", "if", "while", "for", "break", "continue", "return", "else",
-  "struct", "union", "typedef", "static", "enum", "class", "case",
-  "int|", "long|", "double|", "float|", "char|", "unsigned|", "signed|",
-  "void|", NULL
-};
-struct editorSyntax HLDB[] = {
-  {
-    "c",
-    C_HL_extensions,
-    C_HL_keywords,
-    "//", "/*", "*/",
-    HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
-  },
-};
-#define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
+int editorReplaying() {
+  return conf.replay.keys != NULL;
+}
+
+// everything drawn goes through here, so a replay can keep it
+void editorWrite(const char *s, size_t len) {
+  struct editorReplay *r = &conf.replay;
+  if (!editorReplaying()) {
+    write(STDOUT_FILENO, s, len);
+    return;
+  }
+  if (r->out_len + len > r->out_cap) {
+    r->out_cap = r->out_cap ? r->out_cap * 2 : 1 << 16;
+    while (r->out_cap < r->out_len + len) r->out_cap *= 2;
+    r->out = realloc(r->out, r->out_cap);
+    if (!r->out) die("realloc");
+  }
+  memcpy(r->out + r->out_len, s, len);
+  r->out_len += len;
+}
 
 void editorClearScreen(){
-  write(STDOUT_FILENO, "\x1b[2J", 4);
-  write(STDOUT_FILENO, "\x1b[H", 3);
+  editorWrite("\x1b[2J\x1b[H", 7);
 }
 
 
@@ -120,493 +327,3791 @@ void die(const char *s) {
   exit(1);
 }
 
-int editorRowCxToRx(struct editorRow *row, int cx) {
-  int rx = 0;
-  for (int j = 0; j < cx; j++) {
-    if (row->chars[j] == '\t')
-      rx += (ZUMA_TAB_STOP - 1) - (rx % ZUMA_TAB_STOP);
-    rx++;
+/*** row storage ***/
+
+// rows are made and dropped by the thousand when leaves are built and one
+// key at a time while typing, so they don't go through malloc: a block is
+// rounded up to a size class, cut from a big slab with a bump pointer and
+// put back on its class's free list when freed. Slabs are never returned.
+// Only the main thread builds or frees rows.
+#define HEAP_SLAB (256 * 1024)
+#define HEAP_TEXT_SLAB (1024 * 1024)
+#define HEAP_LARGE HEAP_CLASSES   // class of blocks too big for a free list
+
+static const int heapClassSize[HEAP_CLASSES] = {
+  16, 32, 48, 64, 80, 96, 112, 128, 144, 160, 176, 192, 208, 224, 240, 256,
+  384, 512, 768, 1024, 1536, 2048, 3072, 4096
+};
+
+int heapClass(size_t n) {
+  if (n <= 256) return n ? (n - 1) >> 4 : 0;
+  for (int c = 16; c < HEAP_CLASSES; c++)
+    if (n <= (size_t) heapClassSize[c]) return c;
+  return HEAP_LARGE;
+}
+
+// room a block asked for as n bytes really has
+size_t heapRoundUp(size_t n) {
+  int c = heapClass(n);
+  return c == HEAP_LARGE ? n : (size_t) heapClassSize[c];
+}
+
+void *heapAlloc(size_t n) {
+  struct rowHeap *h = &conf.heap;
+  int c = heapClass(n);
+  h->allocs++;
+  if (c == HEAP_LARGE) {
+    void *p = malloc(n);
+    if (!p) die("malloc");
+    h->large++;
+    return p;
   }
-  return rx;
+  int size = heapClassSize[c];
+  h->live_bytes += size;
+  if (h->free[c]) {
+    void *p = h->free[c];
+    h->free[c] = *(void **) p;
+    h->reused++;
+    return p;
+  }
+  if (!h->bump || h->end - h->bump < size) {
+    h->bump = malloc(HEAP_SLAB);
+    if (!h->bump) die("malloc");
+    h->end = h->bump + HEAP_SLAB;
+    h->slab_bytes += HEAP_SLAB;
+  }
+  void *p = h->bump;
+  h->bump += size;
+  return p;
 }
 
-int editorRowRxToCx(struct editorRow *row, int rx) {
-  int crx = 0;
-  int cx;
-  for (cx = 0; cx < row->size; cx++) {
-    if (row->chars[cx] == '\t')
-      crx += (ZUMA_TAB_STOP - 1) - (crx % ZUMA_TAB_STOP);
-    crx++;
-    if (crx > rx) return cx;
+// n is what the block was allocated as, or anything in the same class
+void heapFree(void *p, size_t n) {
+  if (!p) return;
+  struct rowHeap *h = &conf.heap;
+  int c = heapClass(n);
+  h->frees++;
+  if (c == HEAP_LARGE) {
+    free(p);
+    return;
   }
-  return cx;
+  h->live_bytes -= heapClassSize[c];
+  *(void **) p = h->free[c];
+  h->free[c] = p;
 }
 
+void *heapRealloc(void *p, size_t old, size_t n) {
+  int c = heapClass(n);
+  if (p && c == heapClass(old)) {
+    if (c != HEAP_LARGE) return p;
+    p = realloc(p, n);
+    if (!p) die("realloc");
+    return p;
+  }
+  void *q = heapAlloc(n);
+  if (p) {
+    memcpy(q, p, old < n ? old : n);
+    heapFree(p, old);
+  }
+  return q;
+}
 
-void editorUpdateRow(struct editorRow *row) {
-  int tabs = 0;
-  for (int j = 0; j < row->size; j++) if (row->chars[j] == '\t') tabs++;
-  free(row->render);
-  row->render = malloc(row->size + tabs * (ZUMA_TAB_STOP - 1) + 1);
-  int index = 0;
-  for (int j = 0; j < row->size; j++) {
-    if (row->chars[j] == '\t') {
-      row->render[index++] = ' ';
-      while (index % ZUMA_TAB_STOP != 0) row->render[index++] = ' ';
-    } else {
-      row->render[index++] = row->chars[j];
-    }
+// text of rows read at open, kept like the file mapping until exit
+char *heapText(const char *p, size_t n) {
+  struct rowHeap *h = &conf.heap;
+  if (!h->text || (size_t) (h->text_end - h->text) < n + 1) {
+    size_t slab = n + 1 > HEAP_TEXT_SLAB ? n + 1 : HEAP_TEXT_SLAB;
+    h->text = malloc(slab);
+    if (!h->text) die("malloc");
+    h->text_end = h->text + slab;
+    h->text_bytes += slab;
   }
-  row->render[index] = '\0';
-  row->rsize = index;
+  char *t = h->text;
+  memcpy(t, p, n);
+  t[n] = '\0';
+  h->text += n + 1;
+  return t;
+}
 
+/*** stats ***/
 
-  editorUpdateSyntax(row);
+// counters and log2 histograms of what makes typing feel slow. They are
+// collected once ZUMA_STATS is set, Ctrl-T turns on the overlay in the
+// status bar or SIGUSR1 asks for a dump to ZUMA_STATS_FILE (a new
+// $TMPDIR/zuma-stats.PID.XXXXXX by default); until then each hook is a
+// branch.
+#define STAT_BUCKETS 48
+
+struct statHist {
+  unsigned long n;
+  unsigned long long sum, max;
+  unsigned long bucket[STAT_BUCKETS];   // bucket b holds values below 2^b
+};
+
+struct editorStats {
+  int enabled;
+  int overlay;                    // in place of the status bar's file name
+  time_t since;
+  unsigned long long key_start;   // when the oldest key not yet painted came
+  unsigned long key_allocs;       // row storage allocations at that point
+  unsigned version;               // conf.version at the last edit seen
+  unsigned long rehighlighted;    // rows redone since then
+  struct statHist key;            // ns from reading a key to painting it
+  struct statHist syntax;         // ns in one editorUpdateSyntax
+  struct statHist rows;           // rows re-highlighted per edit
+  struct statHist frame;          // bytes written per frame
+  struct statHist allocs;         // row storage allocations per key
+} stats;
+
+unsigned long long statsNow() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
 }
 
+void statsEnable() {
+  if (stats.enabled) return;
+  stats.enabled = 1;
+  stats.since = time(NULL);
+  stats.version = conf.version;
+}
 
-void editorInsertRow(int loc, char *line, size_t linelen) {
-  if (loc < 0 || loc > conf.nrows) return;
+void statAdd(struct statHist *h, unsigned long long v) {
+  int b = v ? 64 - __builtin_clzll(v) : 0;
+  if (b >= STAT_BUCKETS) b = STAT_BUCKETS - 1;
+  h->n++;
+  h->sum += v;
+  if (v > h->max) h->max = v;
+  h->bucket[b]++;
+}
 
-  conf.row = realloc(conf.row, sizeof(struct editorRow) * (conf.nrows + 1));
-  memmove(&conf.row[loc + 1], &conf.row[loc], sizeof(struct editorRow) * (conf.nrows - loc));
-  for (int j = loc + 1; j <= conf.nrows; j++) conf.row[j].index++;
-  conf.row[loc].index = loc;
-
-  conf.row[loc].size = linelen;
-  conf.row[loc].chars = malloc(linelen + 1);
-  memcpy(conf.row[loc].chars, line, linelen);
-  conf.row[loc].chars[linelen] = '\0';
-
-  conf.row[loc].rsize = 0;
-  conf.row[loc].render = NULL;
-  conf.row[loc].hl = NULL;
-  conf.row[loc].hl_open_comment = 0;
-  editorUpdateRow(&conf.row[loc]);
-  conf.nrows++; conf.dirty++;
+// the top of the bucket the q quantile falls in
+unsigned long long statQuantile(struct statHist *h, double q) {
+  unsigned long want = q * h->n, seen = 0;
+  for (int b = 0; b < STAT_BUCKETS; b++) {
+    seen += h->bucket[b];
+    if (seen > want) {
+      unsigned long long top = b ? (1ULL << b) - 1 : 0;
+      return top < h->max ? top : h->max;
+    }
+  }
+  return h->max;
+}
 
+double statMean(struct statHist *h) {
+  return h->n ? (double) h->sum / h->n : 0.0;
 }
 
-char *editorRowsToString(int *buflen) {
-  int totlen = 0;
-  int j;
-  for (j = 0; j < conf.nrows; j++)
-    totlen += conf.row[j].size + 1;
-  *buflen = totlen;
-  char *buf = malloc(totlen);
-  char *p = buf;
-  for (j = 0; j < conf.nrows; j++) {
-    memcpy(p, conf.row[j].chars, conf.row[j].size);
-    p += conf.row[j].size;
-    *p = '\n';
-    p++;
+// a key is read: it is timed until painted, and an edit made since the
+// last one closes that one's count of rows re-highlighted
+void statsKeyRead() {
+  if (!stats.enabled) return;
+  if (!stats.key_start) {
+    stats.key_start = statsNow();
+    stats.key_allocs = conf.heap.allocs;
+  }
+  if (conf.version != stats.version) {
+    statAdd(&stats.rows, stats.rehighlighted);
+    stats.rehighlighted = 0;
+    stats.version = conf.version;
   }
-  return buf;
 }
 
-void editorSetStatusMessage(const char *fmt, ...) {
-  va_list ap;
-  va_start(ap, fmt);
-  vsnprintf(conf.statusmsg, sizeof(conf.statusmsg), fmt, ap);
-  va_end(ap);
-  conf.statusmsg_time = time(NULL);
+void statsPainted(size_t bytes) {
+  if (!stats.enabled) return;
+  statAdd(&stats.frame, bytes);
+  if (!stats.key_start) return;
+  statAdd(&stats.key, statsNow() - stats.key_start);
+  statAdd(&stats.allocs, conf.heap.allocs - stats.key_allocs);
+  stats.key_start = 0;
 }
 
+void statsDuration(char *buf, size_t size, unsigned long long ns) {
+  if (ns < 10000) snprintf(buf, size, "%lluns", ns);
+  else if (ns < 10000000) snprintf(buf, size, "%lluus", ns / 1000);
+  else snprintf(buf, size, "%llums", ns / 1000000);
+}
 
-void editorOpen(char* filename) {
-  free(conf.filename);
-  conf.filename = strdup(filename);
+// one line for the status bar
+int statsFormat(char *buf, size_t size) {
+  char p50[16], p99[16], hl[16];
+  statsDuration(p50, sizeof(p50), statQuantile(&stats.key, 0.5));
+  statsDuration(p99, sizeof(p99), statQuantile(&stats.key, 0.99));
+  statsDuration(hl, sizeof(hl), statMean(&stats.syntax));
+  return snprintf(buf, size, "key %s p99 %s | hl %s %.0f rows/edit | %.0f B/frame %.1f alloc/key",
+                  p50, p99, hl, statMean(&stats.rows), statMean(&stats.frame),
+                  statMean(&stats.allocs));
+}
 
-  editorSelectSyntaxHighlight();
+/*** row rope ***/
+
+// rows live in a counted B+ tree: leaves hold row pointers, inner nodes
+// hold children plus the number of rows below them, so finding, inserting
+// and deleting row n are all O(log n) and nothing has to be renumbered.
+#define ROPE_LEAF_MAX 64
+#define ROPE_NODE_MAX 32
+#define ROPE_MAX_DEPTH 24
+
+struct ropeNode {
+  int leaf;
+  int n;
+  int count;
+  int lazy;                       // leaf rows not built yet, see mapline
+  int mapline;                    // first file line of a lazy leaf
+  int hl_in, hl_out, hl_gen;      // highlight checkpoint of a lazy leaf
+  unsigned char *bloom;           // trigrams of the leaf's rows, may be NULL
+  int bloom_bits;                 // log2 of the filter size in bits
+  struct ropeNode *prev, *next;   // leaf chain for sequential scans
+  union {
+    struct ropeNode *child[ROPE_NODE_MAX];
+    struct editorRow *rows[ROPE_LEAF_MAX];
+  } u;
+};
 
-  FILE *fp = fopen(filename, "r");
-  if (!fp) die("fopen");
+struct ropeNode *ropeNewNode(int leaf) {
+  struct ropeNode *node = calloc(1, sizeof(struct ropeNode));
+  if (!node) die("calloc");
+  node->leaf = leaf;
+  return node;
+}
 
-  // read from the file
-  char *line = NULL;
-  size_t linecap = 0;
-  ssize_t linelen;
-  while ((linelen = getline(&line, &linecap, fp)) != -1) {
-    while (linelen > 0 && (line[linelen - 1] == '\n' ||
-                           line[linelen - 1] == '\r'))  linelen--;
-    editorInsertRow(conf.nrows, line, linelen);
+int ropeNodeMax(struct ropeNode *node) {
+  return node->leaf ? ROPE_LEAF_MAX : ROPE_NODE_MAX;
+}
 
+struct editorRow *editorMapRow(int line);
+void editorSetStatusMessage(const char *fmt, ...);
+void indexSplit(struct ropeNode *leaf, struct ropeNode *right);
+void indexJoin(struct ropeNode *a, struct ropeNode *b);
+void indexFree(struct ropeNode *leaf);
+int editorSyntaxIsStateful();
+void editorHighlightRow(struct editorRow *row, int in_comment, int keep);
+void editorJournalRecover();
+void undoRecord(int type, int row, int at, const char *data, int len);
+int undoActive();
+void editorJournal(int op, int row, int arg, const char *data, int len);
+void editorJournalCommit();
+int editorJournalWrite();
+void editorWake(char event);
+int inputWait(int ms);
+void editorJournalCompact(off_t from);
+int editorMapLineLen(int line);
+int editorReplayFill(char *buf);
+void editorReplayNext();
+unsigned char *editorHighlightScratch(int len);
+
+#define EVENT_RESIZE 'w'                // bytes written to the event pipe
+#define EVENT_TASK 't'
+#define EVENT_STATS 's'
+#define INPUT_SEQ_TIMEOUT 100           // ms to wait for the rest of a sequence
+
+// build the rows of a leaf that still only refers to lines of the mapping,
+// handing its highlight checkpoint down to the new rows
+void ropeMaterialize(struct ropeNode *leaf) {
+  if (!leaf->lazy) return;
+  int checkpoint = editorSyntaxIsStateful() && leaf->hl_gen == conf.hl_gen;
+  int state = leaf->hl_in;
+  for (int j = 0; j < leaf->n; j++) {
+    leaf->u.rows[j] = editorMapRow(leaf->mapline + j);
+    if (checkpoint) {
+      editorHighlightRow(leaf->u.rows[j], state, 0);
+      state = leaf->u.rows[j]->hl_open_comment;
+    }
   }
-  free(line);
-  fclose(fp);
-  conf.dirty = 0;
+  leaf->lazy = 0;
 }
 
-void editorSave() {
-  if (!conf.filename) {
-    conf.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
-    if (!conf.filename) return;
+void ropeRecount(struct ropeNode *node) {
+  if (node->leaf) {
+    node->count = node->n;
+    return;
   }
-  editorSelectSyntaxHighlight();
+  node->count = 0;
+  for (int j = 0; j < node->n; j++) node->count += node->u.child[j]->count;
+}
 
-  int len;
-  char *buf = editorRowsToString(&len);
-  int fd = open(conf.filename, O_RDWR | O_CREAT, 0644);
-  if (fd != -1) {
-    if (ftruncate(fd, len) != -1) {
-      if (write(fd, buf, len) == len) {
-        close(fd);
-        free(buf);
-        conf.dirty = 0;
-        editorSetStatusMessage("%d bytes written to disk", len);
-        return;
-      }
-    }
-    close(fd);
+// move the upper half of a full node into a new right sibling
+struct ropeNode *ropeSplit(struct ropeNode *node) {
+  struct ropeNode *right = ropeNewNode(node->leaf);
+  int keep = node->n / 2;
+  right->n = node->n - keep;
+  if (node->leaf) {
+    ropeMaterialize(node);
+    memcpy(right->u.rows, &node->u.rows[keep], sizeof(struct editorRow *) * right->n);
+    right->next = node->next;
+    right->prev = node;
+    if (node->next) node->next->prev = right;
+    node->next = right;
+    indexSplit(node, right);
+  } else {
+    memcpy(right->u.child, &node->u.child[keep], sizeof(struct ropeNode *) * right->n);
   }
-  free(buf);
-  editorSetStatusMessage("I/O error: %s", strerror(errno));
+  node->n = keep;
+  ropeRecount(node);
+  ropeRecount(right);
+  return right;
 }
 
+void ropeInsertChild(struct ropeNode *parent, int at, struct ropeNode *child) {
+  memmove(&parent->u.child[at + 1], &parent->u.child[at],
+    sizeof(struct ropeNode *) * (parent->n - at));
+  parent->u.child[at] = child;
+  parent->n++;
+}
 
-void editorFindCallback(char *query, int key) {
-  static int last_match = -1;
-  static int direction = 1;
+void ropeRemoveChild(struct ropeNode *parent, int at) {
+  memmove(&parent->u.child[at], &parent->u.child[at + 1],
+    sizeof(struct ropeNode *) * (parent->n - at - 1));
+  parent->n--;
+}
 
-  static int saved_hl_line;
-  static char *saved_hl = NULL;
-  if (saved_hl) {
-    memcpy(conf.row[saved_hl_line].hl, saved_hl, conf.row[saved_hl_line].rsize);
-    free(saved_hl);
-    saved_hl = NULL;
+// find the child of an inner node holding row *at, rebasing *at into it
+int ropeChildFor(struct ropeNode *node, int *at) {
+  int j;
+  for (j = 0; j < node->n - 1; j++) {
+    if (*at < node->u.child[j]->count) break;
+    *at -= node->u.child[j]->count;
   }
+  return j;
+}
 
+// locate the leaf holding row at, storing the row's slot in *slot
+struct ropeNode *ropeFindLeaf(int at, int *slot) {
+  struct ropeNode *node = conf.rope;
+  if (!node || at < 0 || at >= node->count) return NULL;
+  while (!node->leaf) node = node->u.child[ropeChildFor(node, &at)];
+  *slot = at;
+  return node;
+}
 
-  if (key == '\r' || key == '\x1b') {
-    last_match = -1;
-    direction = 1;
+struct ropeNode *ropeLeafAt(int at, int *slot) {
+  struct ropeNode *leaf = ropeFindLeaf(at, slot);
+  if (leaf) ropeMaterialize(leaf);
+  return leaf;
+}
+
+struct editorRow *editorRowAt(int at) {
+  int slot;
+  struct ropeNode *leaf = ropeLeafAt(at, &slot);
+  return leaf ? leaf->u.rows[slot] : NULL;
+}
+
+void ropeInsert(int at, struct editorRow *row) {
+  if (!conf.rope) conf.rope = ropeNewNode(1);
+  if (conf.rope->n == ropeNodeMax(conf.rope)) {
+    struct ropeNode *root = ropeNewNode(0);
+    root->u.child[0] = conf.rope;
+    root->n = 1;
+    ropeInsertChild(root, 1, ropeSplit(conf.rope));
+    ropeRecount(root);
+    conf.rope = root;
+  }
+  // split full nodes on the way down so the leaf always has room
+  struct ropeNode *node = conf.rope;
+  while (!node->leaf) {
+    node->count++;
+    int j;
+    for (j = 0; j < node->n - 1; j++) {
+      if (at <= node->u.child[j]->count) break;
+      at -= node->u.child[j]->count;
+    }
+    struct ropeNode *child = node->u.child[j];
+    if (child->n == ropeNodeMax(child)) {
+      ropeInsertChild(node, j + 1, ropeSplit(child));
+      if (at > child->count) {
+        at -= child->count;
+        child = node->u.child[j + 1];
+      }
+    }
+    node = child;
+  }
+  ropeMaterialize(node);
+  memmove(&node->u.rows[at + 1], &node->u.rows[at],
+    sizeof(struct editorRow *) * (node->n - at));
+  node->u.rows[at] = row;
+  node->n++;
+  node->count++;
+}
+
+// even out two adjacent children, merging them when they fit in one node
+void ropeRebalance(struct ropeNode *parent, int j) {
+  struct ropeNode *a = parent->u.child[j], *b = parent->u.child[j + 1];
+  int total = a->n + b->n;
+  size_t width = a->leaf ? sizeof(struct editorRow *) : sizeof(struct ropeNode *);
+  char *aslots = a->leaf ? (char *) a->u.rows : (char *) a->u.child;
+  char *bslots = b->leaf ? (char *) b->u.rows : (char *) b->u.child;
+  if (a->leaf) {
+    ropeMaterialize(a);
+    ropeMaterialize(b);
+    indexJoin(a, b);
+  }
+
+  if (total <= ropeNodeMax(a)) {
+    memcpy(aslots + width * a->n, bslots, width * b->n);
+    a->n = total;
+    if (a->leaf) {
+      a->next = b->next;
+      if (b->next) b->next->prev = a;
+    }
+    ropeRecount(a);
+    ropeRemoveChild(parent, j + 1);
+    indexFree(b);
+    free(b);
     return;
-  } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-    direction = 1;
-  } else if (key == ARROW_LEFT || key == ARROW_UP) {
-    direction = -1;
+  }
+  int want = total / 2;
+  if (a->n < want) {
+    int move = want - a->n;
+    memcpy(aslots + width * a->n, bslots, width * move);
+    memmove(bslots, bslots + width * move, width * (b->n - move));
+    a->n += move;
+    b->n -= move;
   } else {
-    last_match = -1;
-    direction = 1;
+    int move = a->n - want;
+    memmove(bslots + width * move, bslots, width * b->n);
+    memcpy(bslots, aslots + width * want, width * move);
+    a->n -= move;
+    b->n += move;
   }
+  ropeRecount(a);
+  ropeRecount(b);
+}
 
-  if (last_match == -1) direction = 1;
-  int current = last_match;
-  for (int i = 0; i < conf.nrows; i++) {
-    current += direction;
-    if (current == -1) current = conf.nrows - 1;
-    else if (current == conf.nrows) current = 0;
-
-    struct editorRow *row = &conf.row[current];
-    char *match = strstr(row->render, query);
-    if (match) {
-      last_match = current;
-      conf.cy = current;
-      conf.cy = i;
-      conf.cx = editorRowRxToCx(row, match - row->render);
-      conf.rowoff = conf.nrows;
+struct editorRow *ropeRemove(int at) {
+  if (!conf.rope || at < 0 || at >= conf.rope->count) return NULL;
+  // top up thin children on the way down so removal never underflows
+  struct ropeNode *node = conf.rope;
+  while (!node->leaf) {
+    int j = ropeChildFor(node, &at);
+    struct ropeNode *child = node->u.child[j];
+    if (child->n <= ropeNodeMax(child) / 4 && node->n > 1) {
+      int left = (j > 0) ? j - 1 : j;
+      if (left < j) at += node->u.child[left]->count;
+      ropeRebalance(node, left);
+      j = left;
+      if (j + 1 < node->n && at >= node->u.child[j]->count) {
+        at -= node->u.child[j]->count;
+        j++;
+      }
+      child = node->u.child[j];
+    }
+    node->count--;
+    node = child;
+  }
+  ropeMaterialize(node);
+  struct editorRow *row = node->u.rows[at];
+  memmove(&node->u.rows[at], &node->u.rows[at + 1],
+    sizeof(struct editorRow *) * (node->n - at - 1));
+  node->n--;
+  node->count--;
+
+  while (!conf.rope->leaf && conf.rope->n == 1) {
+    struct ropeNode *root = conf.rope;
+    conf.rope = root->u.child[0];
+    free(root);
+  }
+  return row;
+}
 
-      saved_hl_line = current;
-      saved_hl = malloc(row->rsize);
-      memcpy(saved_hl, row->hl, row->rsize);
+struct ropeNode *ropeFirstLeaf() {
+  struct ropeNode *node = conf.rope;
+  while (node && !node->leaf) node = node->u.child[0];
+  return node;
+}
 
-      memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-      break;
+// build a tree of lazy leaves over the first nlines lines of the mapping;
+// nodes are left a quarter empty so early edits don't split them at once
+void ropeBuildLazy(int nlines) {
+  if (nlines <= 0) return;
+  int fill = ROPE_LEAF_MAX * 3 / 4;
+  int nnodes = (nlines + fill - 1) / fill;
+  struct ropeNode **level = malloc(sizeof(struct ropeNode *) * nnodes);
+  if (!level) die("malloc");
+  for (int j = 0; j < nnodes; j++) {
+    struct ropeNode *leaf = ropeNewNode(1);
+    leaf->lazy = 1;
+    leaf->mapline = j * fill;
+    leaf->n = leaf->count = (nlines - j * fill < fill) ? nlines - j * fill : fill;
+    if (j > 0) {
+      leaf->prev = level[j - 1];
+      level[j - 1]->next = leaf;
+    }
+    level[j] = leaf;
+  }
+  fill = ROPE_NODE_MAX * 3 / 4;
+  while (nnodes > 1) {
+    int nparents = (nnodes + fill - 1) / fill;
+    for (int j = 0; j < nparents; j++) {
+      struct ropeNode *parent = ropeNewNode(0);
+      for (int k = j * fill; k < nnodes && k < (j + 1) * fill; k++)
+        parent->u.child[parent->n++] = level[k];
+      ropeRecount(parent);
+      level[j] = parent;
     }
+    nnodes = nparents;
   }
+  conf.rope = level[0];
+  free(level);
 }
 
-void editorFind() {
-  int saved_cx = conf.cx;
-  int saved_cy = conf.cy;
-  int saved_coloff = conf.coloff;
-  int saved_rowoff = conf.rowoff;
-  char *query = editorPrompt("Search: %s (Esc/Enter/Arrows)",
-                              editorFindCallback);
-  if (!query) {
-    conf.cx = saved_cx;
-    conf.cy = saved_cy;
-    conf.coloff = saved_coloff;
-    conf.rowoff = saved_rowoff;
-  return;
+// sequential access along the leaf chain, O(1) per step
+struct rowIter {
+  struct ropeNode *leaf;
+  int slot;
+};
+
+struct editorRow *rowIterStart(struct rowIter *it, int at) {
+  it->leaf = ropeLeafAt(at, &it->slot);
+  return it->leaf ? it->leaf->u.rows[it->slot] : NULL;
 }
-  free(query);
+
+struct editorRow *rowIterNext(struct rowIter *it) {
+  if (!it->leaf) return NULL;
+  if (++it->slot >= it->leaf->n) {
+    it->leaf = it->leaf->next;
+    it->slot = 0;
+    while (it->leaf && it->leaf->n == 0) it->leaf = it->leaf->next;
+    if (!it->leaf) return NULL;
+    ropeMaterialize(it->leaf);
+  }
+  return it->leaf->u.rows[it->slot];
 }
 
-// disable raw mode at exit
-void disableRawMode(){
-  if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &(conf.orig_termios)) == -1)
-    die("tcsetattr");
+struct editorRow *rowIterPrev(struct rowIter *it) {
+  if (!it->leaf) return NULL;
+  if (--it->slot < 0) {
+    it->leaf = it->leaf->prev;
+    while (it->leaf && it->leaf->n == 0) it->leaf = it->leaf->prev;
+    if (!it->leaf) return NULL;
+    ropeMaterialize(it->leaf);
+    it->slot = it->leaf->n - 1;
+  }
+  return it->leaf->u.rows[it->slot];
 }
 
-// turn off echoing and canonical mode
-void enableRawMode(){
-  if (tcgetattr(STDIN_FILENO, &(conf.orig_termios)) == -1) die("tcgetattr");
-  atexit(disableRawMode);
+/*** snapshots ***/
+
+// the rows as they were at one moment, as spans of text for another thread
+// to read while editing goes on: a whole lazy leaf is one span of the
+// mapping, any other row a span of its own. The version says whether the
+// buffer is still the one the snapshot was taken from.
+struct snapSpan {
+  const char *p;
+  size_t len;
+  int row;                        // first row of the span
+  int n;                          // rows in it, one unless line is set
+  int line;                       // first line of a lazy leaf, or -1
+};
 
-  struct termios raw = (conf.orig_termios);
+struct snapshot {
+  unsigned version;
+  struct snapSpan *spans;
+  int nspans, cap;
+  size_t bytes;
+};
 
-  // fix Ctrl-M and disable Ctrl-S, Ctrl-Q, and other miscellaneous flags
-  raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
-  // turn off all output processing
-  raw.c_oflag &= ~(OPOST);
-  raw.c_cflag |= (CS8);
-  // disable Ctrl-C, Ctrl-Z, and Ctrl-V
-  raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
-  raw.c_cc[VMIN] = 0;
-  raw.c_cc[VTIME] = 1;
+void editorShareAcquire() {
+  conf.share.readers++;
+}
 
-  if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr");
+// the last reader is done: the text edited away from under it can go
+void editorShareRelease() {
+  if (--conf.share.readers > 0) return;
+  for (int j = 0; j < conf.share.norphans; j++)
+    heapFree(conf.share.orphans[j].p, conf.share.orphans[j].n);
+  conf.share.norphans = 0;
 }
 
-int getCursorPosition(int *n_row, int *n_col) {
-  char buf[32];
-  unsigned int i = 0;
-  if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) return -1;
-  while (i < sizeof(buf) - 1) {
-    if (read(STDIN_FILENO, &buf[i], 1) != 1) break;
-    if (buf[i] == 'R') break;
-    i++;
+struct snapshot *snapshotNew() {
+  struct snapshot *snap = calloc(1, sizeof(struct snapshot));
+  if (!snap) die("calloc");
+  snap->version = conf.version;
+  editorShareAcquire();
+  return snap;
+}
+
+void snapshotFree(struct snapshot *snap) {
+  if (!snap) return;
+  editorShareRelease();
+  free(snap->spans);
+  free(snap);
+}
+
+void snapshotAdd(struct snapshot *snap, const char *p, size_t len, int row, int n, int line) {
+  if (snap->nspans == snap->cap) {
+    snap->cap = snap->cap ? snap->cap * 2 : 256;
+    snap->spans = realloc(snap->spans, sizeof(struct snapSpan) * snap->cap);
+    if (!snap->spans) die("realloc");
+  }
+  struct snapSpan *sp = &snap->spans[snap->nspans++];
+  sp->p = p;
+  sp->len = len;
+  sp->row = row;
+  sp->n = n;
+  sp->line = line;
+  snap->bytes += len;
+}
+
+// the rows of leaf from slot on, the first of them being row at
+void snapshotAddLeaf(struct snapshot *snap, struct ropeNode *leaf, int slot, int at) {
+  if (leaf->lazy) {
+    size_t start = conf.map.lines[leaf->mapline];
+    size_t end = conf.map.lines[leaf->mapline + leaf->n];
+    if (end > conf.map.len) end = conf.map.len;
+    snapshotAdd(snap, conf.map.data + start, end - start, at, leaf->n, leaf->mapline);
+    return;
+  }
+  for (int j = slot; j < leaf->n; j++) {
+    struct editorRow *row = leaf->u.rows[j];
+    if (!(row->flags & ROW_MAPPED)) row->flags |= ROW_SHARED;
+    snapshotAdd(snap, row->chars, row->size, at + j - slot, 1, -1);
+  }
+}
+
+// a row of a span, in the span's nth place
+const char *snapRowText(struct snapSpan *sp, int nth, int *len) {
+  if (sp->line < 0) {
+    *len = sp->len;
+    return sp->p;
+  }
+  *len = editorMapLineLen(sp->line + nth);
+  return conf.map.data + conf.map.lines[sp->line + nth];
+}
+
+// cut the spans into runs of about size bytes; returns how many runs,
+// with the first span of each in starts and the count after them
+int snapshotSplit(struct snapshot *snap, size_t size, int **starts) {
+  int n = 0, cap = 16;
+  *starts = malloc(sizeof(int) * (cap + 1));
+  if (!*starts) die("malloc");
+  size_t bytes = size;
+  for (int s = 0; s < snap->nspans; s++) {
+    if (bytes >= size) {
+      if (n == cap) {
+        cap *= 2;
+        *starts = realloc(*starts, sizeof(int) * (cap + 1));
+        if (!*starts) die("realloc");
+      }
+      (*starts)[n++] = s;
+      bytes = 0;
+    }
+    bytes += snap->spans[s].len;
+  }
+  (*starts)[n] = snap->nspans;
+  return n;
+}
+
+/*** tasks ***/
+
+// bulk passes over the buffer (searching it, highlighting ahead of the
+// viewport, building the search index) are cut into tasks for a few
+// worker threads, each reading a snapshot instead of the rope. Every
+// worker has a queue per priority, takes the oldest task from its own and
+// the newest from another's once its own are empty. Finished tasks go on a
+// list pushed to without locks, and the UI thread is woken to fold their
+// results in, throwing them away if the buffer was edited meanwhile.
+// ZUMA_THREADS sets the number of workers, 0 for doing it all in between
+// keys on the UI thread as before.
+#define TASK_MAX_THREADS 8
+
+enum taskPriority {
+  TASK_HIGH,                      // someone is waiting on it
+  TASK_LOW,                       // work ahead of need
+  TASK_PRIORITIES
+};
+
+struct task {
+  void (*run)(struct task *t);    // on a worker
+  void (*done)(struct task *t);   // back on the UI thread, cancelled or not
+  int *cancel;                    // nonzero once the result isn't wanted
+  struct task *next;              // on the finished list
+};
+
+struct taskQueue {
+  pthread_mutex_t lock;
+  struct task **items;            // a ring, see taskQueuePop
+  int head, len, cap;
+};
+
+struct taskWorker {
+  pthread_t thread;
+  struct taskQueue q[TASK_PRIORITIES];
+};
+
+struct taskPool {
+  int nworkers;
+  struct taskWorker *workers;
+  pthread_mutex_t lock;           // held only to go to sleep and to wake
+  pthread_cond_t wake;
+  int queued;                     // tasks not taken yet
+  int next;                       // worker handed the next task
+  struct task *finished;
+} pool;
+
+void taskQueuePush(struct taskQueue *q, struct task *t) {
+  pthread_mutex_lock(&q->lock);
+  if (q->len == q->cap) {
+    int cap = q->cap ? q->cap * 2 : 64;
+    struct task **items = malloc(sizeof(struct task *) * cap);
+    if (!items) die("malloc");
+    for (int j = 0; j < q->len; j++) items[j] = q->items[(q->head + j) % q->cap];
+    free(q->items);
+    q->items = items;
+    q->head = 0;
+    q->cap = cap;
+  }
+  q->items[(q->head + q->len++) % q->cap] = t;
+  pthread_mutex_unlock(&q->lock);
+}
+
+// the owner takes from the front, in the order tasks were queued, and a
+// thief from the back, the work furthest from being reached
+struct task *taskQueuePop(struct taskQueue *q, int steal) {
+  pthread_mutex_lock(&q->lock);
+  struct task *t = NULL;
+  if (q->len > 0) {
+    if (steal) {
+      t = q->items[(q->head + q->len - 1) % q->cap];
+    } else {
+      t = q->items[q->head];
+      q->head = (q->head + 1) % q->cap;
+    }
+    q->len--;
+  }
+  pthread_mutex_unlock(&q->lock);
+  return t;
+}
+
+struct task *taskTake(int self) {
+  for (int p = 0; p < TASK_PRIORITIES; p++) {
+    struct task *t = taskQueuePop(&pool.workers[self].q[p], 0);
+    for (int j = 1; !t && j < pool.nworkers; j++)
+      t = taskQueuePop(&pool.workers[(self + j) % pool.nworkers].q[p], 1);
+    if (t) {
+      __atomic_sub_fetch(&pool.queued, 1, __ATOMIC_RELAXED);
+      return t;
+    }
+  }
+  return NULL;
+}
+
+int taskCancelled(struct task *t) {
+  return __atomic_load_n(t->cancel, __ATOMIC_RELAXED);
+}
+
+void taskCancel(int *cancel) {
+  __atomic_store_n(cancel, 1, __ATOMIC_RELAXED);
+}
+
+void *taskWorkerMain(void *arg) {
+  int self = (int) (intptr_t) arg;
+  for (;;) {
+    struct task *t = taskTake(self);
+    if (!t) {
+      pthread_mutex_lock(&pool.lock);
+      while (__atomic_load_n(&pool.queued, __ATOMIC_RELAXED) <= 0)
+        pthread_cond_wait(&pool.wake, &pool.lock);
+      pthread_mutex_unlock(&pool.lock);
+      continue;
+    }
+    if (!taskCancelled(t)) t->run(t);
+    // only the push onto an empty list needs to wake the UI thread
+    struct task *head = __atomic_load_n(&pool.finished, __ATOMIC_RELAXED);
+    do {
+      t->next = head;
+    } while (!__atomic_compare_exchange_n(&pool.finished, &head, t, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    if (!head) editorWake(EVENT_TASK);
+  }
+  return NULL;
+}
+
+void editorTasksInit() {
+  char *env = getenv("ZUMA_THREADS");
+  long n = env ? atoi(env) : sysconf(_SC_NPROCESSORS_ONLN) - 1;
+  if (n < 0) n = 0;
+  if (!env && n < 1) n = 1;
+  if (n > TASK_MAX_THREADS) n = TASK_MAX_THREADS;
+  pthread_mutex_init(&pool.lock, NULL);
+  pthread_cond_init(&pool.wake, NULL);
+  pool.workers = calloc(n ? n : 1, sizeof(struct taskWorker));
+  if (!pool.workers) die("calloc");
+  for (int j = 0; j < n; j++)
+    for (int p = 0; p < TASK_PRIORITIES; p++)
+      pthread_mutex_init(&pool.workers[j].q[p].lock, NULL);
+  // the queue of a worker that failed to start is emptied by the others
+  pool.nworkers = n;
+  for (int j = 0; j < n; j++) {
+    if (pthread_create(&pool.workers[j].thread, NULL, taskWorkerMain,
+                       (void *) (intptr_t) j) != 0) {
+      if (j == 0) pool.nworkers = 0;
+      break;
+    }
+  }
+}
+
+void editorTaskSubmit(struct task *t, int priority) {
+  taskQueuePush(&pool.workers[pool.next].q[priority], t);
+  pool.next = (pool.next + 1) % pool.nworkers;
+  pthread_mutex_lock(&pool.lock);
+  __atomic_add_fetch(&pool.queued, 1, __ATOMIC_RELAXED);
+  pthread_cond_signal(&pool.wake);
+  pthread_mutex_unlock(&pool.lock);
+}
+
+// hand finished tasks to their owners, oldest first; returns whether
+// there were any
+int editorTasksReap() {
+  struct task *t = __atomic_exchange_n(&pool.finished, NULL, __ATOMIC_ACQUIRE);
+  struct task *fifo = NULL;
+  while (t) {
+    struct task *next = t->next;
+    t->next = fifo;
+    fifo = t;
+    t = next;
+  }
+  int any = fifo != NULL;
+  while (fifo) {
+    struct task *next = fifo->next;
+    fifo->done(fifo);
+    fifo = next;
+  }
+  return any;
+}
+
+/*** search index ***/
+
+// a leaf can carry a Bloom filter of the trigrams in its rows, letting a
+// search skip leaves that lack any trigram of the query. edits only ever
+// add bits, so a filter may say yes wrongly but never no
+#define INDEX_MIN_BYTES (4 << 20)       // smaller buffers are just scanned
+#define INDEX_CAP_MB 256
+#define INDEX_MAX_BITS_PER_BYTE 2
+#define INDEX_IDLE_SLICE 256            // leaves filtered per slice or task
+
+unsigned indexHash(const unsigned char *p) {
+  unsigned h = (p[0] | p[1] << 8 | p[2] << 16) * 0x9E3779B1u;
+  return h ^ (h >> 15);
+}
+
+// each trigram sets two bits, both taken from its hash
+#define INDEX_BIT2(h) (((h) * 0x85EBCA77u) >> 11)
+
+void indexAddBits(unsigned char *bloom, int bits, const char *text, size_t len) {
+  unsigned mask = (1u << bits) - 1;
+  const unsigned char *p = (const unsigned char *) text;
+  for (size_t j = 0; j + 2 < len; j++) {
+    unsigned h = indexHash(p + j);
+    unsigned b1 = h & mask, b2 = INDEX_BIT2(h) & mask;
+    bloom[b1 >> 3] |= 1 << (b1 & 7);
+    bloom[b2 >> 3] |= 1 << (b2 & 7);
+  }
+}
+
+void indexAddText(struct ropeNode *leaf, const char *text, size_t len) {
+  indexAddBits(leaf->bloom, leaf->bloom_bits, text, len);
+}
+
+int indexMayHold(struct ropeNode *leaf, unsigned *hashes, int n) {
+  if (!leaf->bloom) return 1;
+  unsigned mask = (1u << leaf->bloom_bits) - 1;
+  for (int j = 0; j < n; j++) {
+    unsigned b1 = hashes[j] & mask, b2 = INDEX_BIT2(hashes[j]) & mask;
+    if (!(leaf->bloom[b1 >> 3] & (1 << (b1 & 7))) ||
+        !(leaf->bloom[b2 >> 3] & (1 << (b2 & 7))))
+      return 0;
+  }
+  return 1;
+}
+
+size_t indexLeafBytes(struct ropeNode *leaf) {
+  if (leaf->lazy) {
+    size_t end = conf.map.lines[leaf->mapline + leaf->n];
+    if (end > conf.map.len) end = conf.map.len;
+    return end - conf.map.lines[leaf->mapline];
+  }
+  size_t bytes = 0;
+  for (int j = 0; j < leaf->n; j++) bytes += leaf->u.rows[j]->size + 1;
+  return bytes;
+}
+
+// count a filter of 2^bits bits against the cap, unless it would pass it
+int indexReserve(int bits) {
+  size_t size = ((size_t) 1 << bits) / 8;
+  if (conf.index.bytes + size > conf.index.cap) {
+    conf.index.capped = 1;
+    return -1;
+  }
+  conf.index.bytes += size;
+  return 0;
+}
+
+void indexUnreserve(int bits) {
+  conf.index.bytes -= ((size_t) 1 << bits) / 8;
+}
+
+// give a leaf a filter sized by its text, unless that would pass the cap
+int indexAlloc(struct ropeNode *leaf, int bits) {
+  if (indexReserve(bits) == -1) return -1;
+  leaf->bloom = calloc(((size_t) 1 << bits) / 8, 1);
+  if (!leaf->bloom) {
+    indexUnreserve(bits);
+    return -1;
+  }
+  leaf->bloom_bits = bits;
+  return 0;
+}
+
+void indexFree(struct ropeNode *leaf) {
+  if (!leaf->bloom) return;
+  indexUnreserve(leaf->bloom_bits);
+  free(leaf->bloom);
+  leaf->bloom = NULL;
+}
+
+int indexLeafBits(struct ropeNode *leaf) {
+  size_t want = indexLeafBytes(leaf) * conf.index.bits_per_byte;
+  int bits = 9;
+  while (bits < 24 && ((size_t) 1 << bits) < want) bits++;
+  return bits;
+}
+
+void indexBuildLeaf(struct ropeNode *leaf) {
+  if (indexAlloc(leaf, indexLeafBits(leaf)) == -1) return;
+  if (leaf->lazy) {
+    indexAddText(leaf, conf.map.data + conf.map.lines[leaf->mapline],
+                 indexLeafBytes(leaf));
+  } else {
+    for (int j = 0; j < leaf->n; j++)
+      indexAddText(leaf, leaf->u.rows[j]->chars, leaf->u.rows[j]->size);
+  }
+}
+
+// both halves of a split leaf hold a subset of what it held
+void indexSplit(struct ropeNode *leaf, struct ropeNode *right) {
+  if (!leaf->bloom || indexAlloc(right, leaf->bloom_bits) == -1) return;
+  memcpy(right->bloom, leaf->bloom, ((size_t) 1 << leaf->bloom_bits) / 8);
+}
+
+// rows are about to move between two neighbouring leaves; union their
+// filters, or drop both for the builder to redo if their sizes differ
+void indexJoin(struct ropeNode *a, struct ropeNode *b) {
+  if (!a->bloom && !b->bloom) return;
+  if (a->bloom && b->bloom && a->bloom_bits == b->bloom_bits) {
+    size_t size = ((size_t) 1 << a->bloom_bits) / 8;
+    for (size_t j = 0; j < size; j++) a->bloom[j] = b->bloom[j] |= a->bloom[j];
+    return;
+  }
+  indexFree(a);
+  indexFree(b);
+  if (conf.index.enabled) conf.index.build_row = 0;
+}
+
+// len bytes of a row's text from at are new, or at is where text was
+// taken out if len is 0: add the trigrams that overlap them, the only
+// ones the row may have gained
+void editorIndexRow(int filerow, int at, int len) {
+  int slot;
+  struct ropeNode *leaf = ropeFindLeaf(filerow, &slot);
+  if (!leaf || !leaf->bloom) return;
+  if (leaf->lazy) return;
+  struct editorRow *row = leaf->u.rows[slot];
+  int from = at > 2 ? at - 2 : 0;
+  int to = at + len + 2 < row->size ? at + len + 2 : row->size;
+  indexAddText(leaf, &row->chars[from], to - from);
+}
+
+// decide after opening whether the buffer is big enough to be worth an
+// index; ZUMA_INDEX=0 or 1 turns it off or on regardless of size and
+// ZUMA_INDEX_MB sets how much memory the filters may take
+void editorIndexStart(size_t text) {
+  char *env = getenv("ZUMA_INDEX");
+  conf.index.enabled = env ? atoi(env) != 0 : text >= INDEX_MIN_BYTES;
+  if (!conf.index.enabled) return;
+  env = getenv("ZUMA_INDEX_MB");
+  conf.index.cap = (size_t) ((env && atoi(env) > 0) ? atoi(env) : INDEX_CAP_MB) << 20;
+  conf.index.text = text;
+  conf.index.bits_per_byte = text ? conf.index.cap * 8 / text : INDEX_MAX_BITS_PER_BYTE;
+  if (conf.index.bits_per_byte > INDEX_MAX_BITS_PER_BYTE)
+    conf.index.bits_per_byte = INDEX_MAX_BITS_PER_BYTE;
+  if (conf.index.bits_per_byte < 1) conf.index.bits_per_byte = 1;
+  conf.index.build_row = 0;
+}
+
+void indexReport() {
+  if (conf.index.reported) return;
+  conf.index.reported = 1;
+  editorSetStatusMessage("Search index: %zu KB for %zu MB of text%s",
+                         conf.index.bytes >> 10, conf.index.text >> 20,
+                         conf.index.capped ? " (capped)" : "");
+}
+
+int editorIndexPending() {
+  return conf.index.enabled && conf.index.build_row >= 0;
+}
+
+// filter up to budget more leaves, resuming where the last call stopped
+void editorIndexBuild(int budget) {
+  int slot;
+  struct ropeNode *leaf = ropeFindLeaf(conf.index.build_row, &slot);
+  for (; leaf && budget > 0; leaf = leaf->next) {
+    if (!leaf->bloom) {
+      indexBuildLeaf(leaf);
+      budget--;
+    }
+    conf.index.build_row += leaf->n - slot;
+    slot = 0;
+  }
+  if (leaf) return;
+  conf.index.build_row = -1;
+  indexReport();
+}
+
+// the filters for a stretch of leaves are worked out on the task pool, a
+// chunk of leaves per task, and hung on their leaves once all are done
+// if nothing was edited meanwhile
+#define INDEX_JOB_LEAVES 4096
+
+struct indexChunk {
+  struct task t;                  // first, so a task is its chunk
+  struct indexJob *job;
+  int first, n;                   // leaves of the job
+};
+
+struct indexJob {
+  int cancelled;
+  struct snapshot *snap;
+  struct ropeNode **leaves;
+  int *bits;
+  int *span0;                     // first span of each leaf, plus the end
+  unsigned char **blooms;
+  int nleaves;
+  int end_row;                    // where the builder goes on, -1 for done
+  struct indexChunk *chunks;
+  int nchunks, outstanding;
+};
+
+void indexChunkRun(struct task *t) {
+  struct indexChunk *c = (struct indexChunk *) t;
+  struct indexJob *job = c->job;
+  struct snapSpan *spans = job->snap->spans;
+  for (int j = c->first; j < c->first + c->n && !taskCancelled(t); j++) {
+    unsigned char *bloom = calloc(((size_t) 1 << job->bits[j]) / 8, 1);
+    if (!bloom) return;
+    for (int s = job->span0[j]; s < job->span0[j + 1]; s++)
+      indexAddBits(bloom, job->bits[j], spans[s].p, spans[s].len);
+    job->blooms[j] = bloom;
+  }
+}
+
+void indexJobFree(struct indexJob *job) {
+  snapshotFree(job->snap);
+  free(job->leaves);
+  free(job->bits);
+  free(job->span0);
+  free(job->blooms);
+  free(job->chunks);
+  free(job);
+}
+
+void indexChunkDone(struct task *t) {
+  struct indexJob *job = ((struct indexChunk *) t)->job;
+  if (--job->outstanding > 0) return;
+  if (conf.index.job == job) conf.index.job = NULL;
+  int keep = !job->cancelled && job->snap->version == conf.version;
+  for (int j = 0; j < job->nleaves; j++) {
+    if (keep && job->blooms[j]) {
+      job->leaves[j]->bloom = job->blooms[j];
+      job->leaves[j]->bloom_bits = job->bits[j];
+    } else {
+      free(job->blooms[j]);
+      indexUnreserve(job->bits[j]);
+    }
+  }
+  if (keep) {
+    conf.index.build_row = job->end_row;
+    if (job->end_row == -1) indexReport();
+  }
+  indexJobFree(job);
+}
+
+void editorIndexCancel() {
+  if (!conf.index.job) return;
+  taskCancel(&conf.index.job->cancelled);
+  conf.index.job = NULL;
+}
+
+void editorIndexSubmit() {
+  struct indexJob *job = calloc(1, sizeof(struct indexJob));
+  if (!job) die("calloc");
+  job->snap = snapshotNew();
+  job->leaves = malloc(sizeof(struct ropeNode *) * INDEX_JOB_LEAVES);
+  job->bits = malloc(sizeof(int) * INDEX_JOB_LEAVES);
+  job->span0 = malloc(sizeof(int) * (INDEX_JOB_LEAVES + 1));
+  job->blooms = calloc(INDEX_JOB_LEAVES, sizeof(unsigned char *));
+  if (!job->leaves || !job->bits || !job->span0 || !job->blooms) die("malloc");
+  int slot;
+  struct ropeNode *leaf = ropeFindLeaf(conf.index.build_row, &slot);
+  int at = conf.index.build_row - slot;
+  for (; leaf && job->nleaves < INDEX_JOB_LEAVES; at += leaf->n, leaf = leaf->next) {
+    if (leaf->bloom) continue;
+    int bits = indexLeafBits(leaf);
+    if (indexReserve(bits) == -1) continue;
+    job->leaves[job->nleaves] = leaf;
+    job->bits[job->nleaves] = bits;
+    job->span0[job->nleaves++] = job->snap->nspans;
+    snapshotAddLeaf(job->snap, leaf, 0, at);
+  }
+  job->span0[job->nleaves] = job->snap->nspans;
+  job->end_row = leaf ? at : -1;
+
+  job->nchunks = (job->nleaves + INDEX_IDLE_SLICE - 1) / INDEX_IDLE_SLICE;
+  job->chunks = calloc(job->nchunks ? job->nchunks : 1, sizeof(struct indexChunk));
+  if (!job->chunks) die("calloc");
+  if (job->nchunks == 0) {
+    conf.index.build_row = job->end_row;
+    if (job->end_row == -1) indexReport();
+    indexJobFree(job);
+    return;
+  }
+  for (int k = 0; k < job->nchunks; k++) {
+    struct indexChunk *c = &job->chunks[k];
+    c->t.run = indexChunkRun;
+    c->t.done = indexChunkDone;
+    c->t.cancel = &job->cancelled;
+    c->job = job;
+    c->first = k * INDEX_IDLE_SLICE;
+    c->n = job->nleaves - c->first < INDEX_IDLE_SLICE ? job->nleaves - c->first : INDEX_IDLE_SLICE;
+  }
+  job->outstanding = job->nchunks;
+  conf.index.job = job;
+  for (int k = 0; k < job->nchunks; k++) editorTaskSubmit(&job->chunks[k].t, TASK_LOW);
+}
+
+/*** long rows ***/
+
+// rows of LONG_ROW_MIN bytes or more, mostly minified files of one line,
+// are never rendered or highlighted whole. Every LONG_STEP bytes or so
+// they keep a mark at a token boundary with the screen column and lexer
+// state there. Mapping columns is then a binary search and a walk of one
+// step, drawing lexes and renders only the columns on screen from the
+// mark before them, and after an edit lexing resumes at the mark before
+// it and stops at the first later mark whose state comes out the same.
+#define LONG_ROW_MIN (1 << 16)
+#define LONG_STEP 4096
+
+unsigned longHash(struct editorRow *row, int cap) {
+  return (unsigned) (((uintptr_t) row >> 4) * 0x9e3779b1u) & (cap - 1);
+}
+
+struct longRow *longRowFind(struct editorRow *row) {
+  struct longTable *t = &conf.longrows;
+  unsigned h = longHash(row, t->cap);
+  while (t->slots[h]->row != row) h = (h + 1) & (t->cap - 1);
+  return t->slots[h];
+}
+
+void longTableInsert(struct longTable *t, struct longRow *lr) {
+  unsigned h = longHash(lr->row, t->cap);
+  while (t->slots[h]) h = (h + 1) & (t->cap - 1);
+  t->slots[h] = lr;
+  t->n++;
+}
+
+void longRowAdd(struct editorRow *row) {
+  struct longTable *t = &conf.longrows;
+  if (2 * (t->n + 1) > t->cap) {
+    struct longTable grown = { calloc(t->cap ? t->cap * 2 : 16, sizeof(struct longRow *)),
+                               t->cap ? t->cap * 2 : 16, 0 };
+    if (!grown.slots) die("calloc");
+    for (int j = 0; j < t->cap; j++)
+      if (t->slots[j]) longTableInsert(&grown, t->slots[j]);
+    free(t->slots);
+    *t = grown;
+  }
+  struct longRow *lr = calloc(1, sizeof(struct longRow));
+  if (!lr) die("calloc");
+  lr->row = row;
+  lr->size = -1;                  // marked on first use
+  longTableInsert(t, lr);
+  row->flags |= ROW_LONG;
+}
+
+void longRowDrop(struct editorRow *row) {
+  struct longTable *t = &conf.longrows;
+  unsigned mask = t->cap - 1;
+  unsigned h = longHash(row, t->cap);
+  while (t->slots[h]->row != row) h = (h + 1) & mask;
+  struct longRow *lr = t->slots[h];
+  // pull later rows of the run back into the hole unless that would put
+  // them before their home slot
+  for (unsigned j = (h + 1) & mask; t->slots[j]; j = (j + 1) & mask) {
+    unsigned home = longHash(t->slots[j]->row, t->cap);
+    if (((j - home) & mask) >= ((j - h) & mask)) {
+      t->slots[h] = t->slots[j];
+      h = j;
+    }
+  }
+  t->slots[h] = NULL;
+  t->n--;
+  free(lr->marks);
+  free(lr);
+  row->flags &= ~ROW_LONG;
+}
+
+size_t longRowBytes(struct editorRow *row) {
+  return sizeof(struct longRow) + longRowFind(row)->cap * sizeof(struct longMark);
+}
+
+// the screen column after chars[from..to) when it starts at rx
+int longWalk(const char *chars, int from, int to, int rx) {
+  const char *tab;
+  while (from < to && (tab = memchr(&chars[from], '\t', to - from))) {
+    rx += tab - &chars[from];
+    rx += ZUMA_TAB_STOP - rx % ZUMA_TAB_STOP;
+    from = tab - chars + 1;
+  }
+  return rx + (to - from);
+}
+
+// the last mark at or before cx
+int longMarkAt(struct longRow *lr, int cx) {
+  int lo = 0, hi = lr->n - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (lr->marks[mid].at <= cx) lo = mid;
+    else hi = mid - 1;
+  }
+  return lo;
+}
+
+// the last mark at or before screen column rx
+int longMarkAtRx(struct longRow *lr, int rx) {
+  int lo = 0, hi = lr->n - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (lr->marks[mid].rx <= rx) lo = mid;
+    else hi = mid - 1;
+  }
+  return lo;
+}
+
+// a change of columns after an edit carries on to the end of the row,
+// unless a tab takes it up
+void longShiftRx(struct longRow *lr, int from, int d) {
+  struct longMark *m = lr->marks;
+  for (int k = from; k < lr->n && d != 0; k++) {
+    int end = (k + 1 < lr->n) ? m[k + 1].at : lr->size;
+    int old = (k + 1 < lr->n) ? m[k + 1].rx : lr->rsize;
+    m[k].rx += d;
+    if (m[k].tabs && d % ZUMA_TAB_STOP)
+      d = longWalk(lr->row->chars, m[k].at, end, m[k].rx) - old;
+  }
+  if (lr->n > 0 && d != 0) lr->rsize += d;
+}
+
+// lex on from the first stale mark, replacing marks as it goes, until the
+// state agrees with a mark the edits haven't changed the text after
+void longRelex(struct longRow *lr) {
+  if (lr->dirty >= lr->n) return;
+  struct editorRow *row = lr->row;
+  struct longMark *m = lr->marks;
+  unsigned char *scratch = editorHighlightScratch(2 * LONG_STEP);
+  struct longMark *fresh = NULL;
+  int nfresh = 0, cap = 0;
+  struct longMark cur = m[lr->dirty];
+  int j = lr->dirty + 1;
+  int converged = 0, d = 0;
+  // the first mark stays even on an empty row
+  while (cur.at < row->size || (nfresh == 0 && lr->dirty == 0)) {
+    while (j < lr->n && m[j].at <= cur.at) j++;
+    int to = cur.at + LONG_STEP;
+    if (j < lr->n && m[j].at <= cur.at + 2 * LONG_STEP) to = m[j].at;
+    struct longMark next = cur;
+    next.at = syntaxLexFrom(conf.syntax, row->chars, row->size, cur.at, to,
+                            scratch, &next.st);
+    next.rx = longWalk(row->chars, cur.at, next.at, cur.rx);
+    cur.tabs = memchr(&row->chars[cur.at], '\t', next.at - cur.at) != NULL;
+    if (nfresh == cap) {
+      cap = cap ? cap * 2 : 16;
+      fresh = realloc(fresh, sizeof(struct longMark) * cap);
+      if (!fresh) die("realloc");
+    }
+    fresh[nfresh++] = cur;
+    if (j < lr->n && next.at == m[j].at && m[j].at >= lr->edited &&
+        !memcmp(&next.st, &m[j].st, sizeof(struct lexState))) {
+      converged = 1;
+      d = next.rx - m[j].rx;
+      break;
+    }
+    cur = next;
+  }
+  if (!converged) {
+    j = lr->n;
+    lr->rsize = cur.rx;
+    lr->out = cur.st.in_comment;
+  }
+
+  // marks[dirty..j) give way to the fresh ones
+  int n = lr->dirty + nfresh + (lr->n - j);
+  if (n > lr->cap) {
+    lr->cap = n + n / 2;
+    lr->marks = realloc(lr->marks, sizeof(struct longMark) * lr->cap);
+    if (!lr->marks) die("realloc");
+    m = lr->marks;
+  }
+  memmove(&m[lr->dirty + nfresh], &m[j], sizeof(struct longMark) * (lr->n - j));
+  if (nfresh) memcpy(&m[lr->dirty], fresh, sizeof(struct longMark) * nfresh);
+  free(fresh);
+  lr->n = n;
+  if (converged) longShiftRx(lr, lr->dirty + nfresh, d);
+  lr->dirty = lr->n;
+  lr->edited = 0;
+}
+
+// a long row's marks, brought up to date with its text, syntax and the
+// comment state flowing into it
+struct longRow *longRowGet(struct editorRow *row) {
+  struct longRow *lr = longRowFind(row);
+  if (lr->size != row->size || lr->gen != conf.hl_gen) {
+    if (lr->cap == 0) {
+      lr->cap = row->size / LONG_STEP + 16;
+      lr->marks = malloc(sizeof(struct longMark) * lr->cap);
+      if (!lr->marks) die("malloc");
+    }
+    memset(&lr->marks[0], 0, sizeof(struct longMark));
+    lr->marks[0].st.prev_sep = 1;
+    lr->n = 1;
+    lr->dirty = 0;
+    lr->edited = INT_MAX;
+    lr->size = row->size;
+    lr->gen = conf.hl_gen;
+    lr->in = -1;
+  }
+  if (lr->in != row->hl_in) {
+    lr->in = row->hl_in;
+    lr->marks[0].st.in_comment = lr->in;
+    lr->dirty = 0;
+  }
+  longRelex(lr);
+  return lr;
+}
+
+// whether a row whose render is being brought up to date is long, making
+// it one or back; a row shrinking well under LONG_ROW_MIN goes back, so an
+// edit or two around the size doesn't flip it each time
+int longRowUpdate(struct editorRow *row) {
+  int is = row->flags & ROW_LONG;
+  if (row->size < (is ? LONG_ROW_MIN / 2 : LONG_ROW_MIN)) {
+    if (is) longRowDrop(row);
+    return 0;
+  }
+  if (!is) longRowAdd(row);
+  return 1;
+}
+
+// delta bytes went into a long row at at, or -delta came out from there.
+// Marks past it move and lexing will resume from the last mark the lexer
+// can't have looked at it from
+void longRowEdit(struct editorRow *row, int at, int delta) {
+  if (!(row->flags & ROW_LONG)) return;
+  struct longRow *lr = longRowFind(row);
+  if (lr->size < 0 || lr->size + delta != row->size) {
+    lr->size = -1;
+    return;
+  }
+  struct longMark *m = lr->marks;
+  int reach = syntaxReach(conf.syntax);
+  int k = longMarkAt(lr, at > reach ? at - reach : 0);
+  // marks in deleted text go, as does one right at its end; later ones move
+  int first = longMarkAt(lr, at) + 1, e = first;
+  int gone = (delta < 0) ? -delta : 0;
+  while (gone && e < lr->n && m[e].at <= at + gone) e++;
+  memmove(&m[first], &m[e], sizeof(struct longMark) * (lr->n - e));
+  if (lr->dirty >= e) lr->dirty -= e - first;
+  lr->n -= e - first;
+  for (int j = first; j < lr->n; j++) m[j].at += delta;
+
+  if (lr->edited > at && lr->edited != INT_MAX)
+    lr->edited = (lr->edited + delta > at) ? lr->edited + delta : at;
+  int end = at + (delta > 0 ? delta : 1);
+  if (lr->edited < end) lr->edited = end;
+  if (lr->dirty > k) lr->dirty = k;
+  lr->size = row->size;
+}
+
+int longRowCxToRx(struct editorRow *row, int cx) {
+  struct longRow *lr = longRowGet(row);
+  struct longMark *m = &lr->marks[longMarkAt(lr, cx)];
+  return longWalk(row->chars, m->at, cx, m->rx);
+}
+
+// the char covering screen column col, walking from chars[from] at column
+// rx, and the column it starts at
+int longColumnCx(const char *chars, int from, int size, int rx, int col, int *start) {
+  for (;;) {
+    int n = (size - from < col - rx) ? size - from : col - rx;
+    const char *tab = memchr(&chars[from], '\t', n);
+    if (!tab) {
+      *start = rx + n;
+      return from + n;
+    }
+    rx += tab - &chars[from];
+    from = tab - chars;
+    int w = ZUMA_TAB_STOP - rx % ZUMA_TAB_STOP;
+    if (col < rx + w) {
+      *start = rx;
+      return from;
+    }
+    rx += w;
+    from++;
+  }
+}
+
+int longRowRxToCx(struct editorRow *row, int rx) {
+  struct longRow *lr = longRowGet(row);
+  struct longMark *m = &lr->marks[longMarkAtRx(lr, rx)];
+  int start;
+  return longColumnCx(row->chars, m->at, row->size, m->rx, rx, &start);
+}
+
+// render and highlight screen columns coloff.. of a long row into one line
+// of a frame, lexing from the mark before them; returns how many it drew
+int longRowWindow(struct editorRow *row, int coloff, int cols,
+                  char *fc, unsigned char *fa) {
+  struct longRow *lr = longRowGet(row);
+  int len = lr->rsize - coloff;
+  if (len <= 0) return 0;
+  if (len > cols) len = cols;
+  struct longMark *m = &lr->marks[longMarkAtRx(lr, coloff)];
+  int srx;
+  int start = longColumnCx(row->chars, m->at, row->size, m->rx, coloff, &srx);
+  int end = start, rx = srx;
+  while (end < row->size && rx < coloff + len) {
+    if (row->chars[end++] == '\t') rx += ZUMA_TAB_STOP - rx % ZUMA_TAB_STOP;
+    else rx++;
+  }
+  int from = m->at;
+  unsigned char *hl = editorHighlightScratch(end - from);
+  struct lexState st = m->st;
+  syntaxLexFrom(conf.syntax, row->chars, row->size, from, end, hl, &st);
+  rx = srx;
+  for (int j = start; j < end; j++) {
+    char c = row->chars[j];
+    int w = (c == '\t') ? ZUMA_TAB_STOP - rx % ZUMA_TAB_STOP : 1;
+    for (; w > 0 && rx < coloff + len; w--, rx++) {
+      if (rx < coloff) continue;
+      fc[rx - coloff] = (c == '\t') ? ' ' : c;
+      fa[rx - coloff] = hl[j - from];
+    }
+  }
+  return len;
+}
+
+int editorRowCxToRx(struct editorRow *row, int cx) {
+  if (row->flags & ROW_LONG) return longRowCxToRx(row, cx);
+  int rx = 0;
+  for (int j = 0; j < cx; j++) {
+    if (row->chars[j] == '\t')
+      rx += (ZUMA_TAB_STOP - 1) - (rx % ZUMA_TAB_STOP);
+    rx++;
+  }
+  return rx;
+}
+
+int editorRowRxToCx(struct editorRow *row, int rx) {
+  if (row->flags & ROW_LONG) return longRowRxToCx(row, rx);
+  int crx = 0;
+  int cx;
+  for (cx = 0; cx < row->size; cx++) {
+    if (row->chars[cx] == '\t')
+      crx += (ZUMA_TAB_STOP - 1) - (crx % ZUMA_TAB_STOP);
+    crx++;
+    if (crx > rx) return cx;
+  }
+  return cx;
+}
+
+
+void editorUpdateRender(struct editorRow *row) {
+  if (!(row->flags & ROW_RENDER_ALIAS)) heapFree(row->render, row->rsize + 1);
+  // hl is as long as render, so it goes too and is rebuilt when drawn
+  heapFree(row->hl, row->rsize + 1);
+  row->hl = NULL;
+  row->flags &= ~(ROW_RENDER_STALE | ROW_RENDER_ALIAS);
+  if (longRowUpdate(row)) {
+    row->render = NULL;
+    row->rsize = 0;
+    return;
+  }
+  int tabs = 0;
+  for (int j = 0; j < row->size; j++) if (row->chars[j] == '\t') tabs++;
+  if (tabs == 0) {
+    row->render = row->chars;
+    row->rsize = row->size;
+    row->flags |= ROW_RENDER_ALIAS;
+    return;
+  }
+  row->render = heapAlloc(row->size + tabs * (ZUMA_TAB_STOP - 1) + 1);
+  int index = 0;
+  for (int j = 0; j < row->size; j++) {
+    if (row->chars[j] == '\t') {
+      row->render[index++] = ' ';
+      while (index % ZUMA_TAB_STOP != 0) row->render[index++] = ' ';
+    } else {
+      row->render[index++] = row->chars[j];
+    }
+  }
+  row->render[index] = '\0';
+  row->rsize = index;
+}
+
+// a row scrolled off screen drops what only drawing it needed
+void editorRowRelease(struct editorRow *row) {
+  if (!(row->flags & ROW_RENDER_ALIAS)) heapFree(row->render, row->rsize + 1);
+  heapFree(row->hl, row->rsize + 1);
+  row->render = NULL;
+  row->hl = NULL;
+  row->rsize = 0;
+  row->flags = (row->flags & ~ROW_RENDER_ALIAS) | ROW_RENDER_STALE;
+}
+
+// multi-line comments make a row's colors depend on the rows above it
+int editorSyntaxIsStateful() {
+  return syntaxIsStateful(conf.syntax);
+}
+
+// the rows below only need re-checking: their state checkpoints tell
+// whether the comment state flowing into them has really changed
+void editorHighlightFrom(int filerow) {
+  if (filerow < conf.hl_frontier) conf.hl_frontier = filerow;
+}
+
+// edits only mark rows; render and hl are rebuilt once the row is needed
+void editorInvalidateRow(int filerow) {
+  struct editorRow *row = editorRowAt(filerow);
+  conf.version++;
+  if (row) row->flags |= ROW_RENDER_STALE | ROW_HL_STALE;
+  editorHighlightFrom(filerow);
+}
+
+// bring a row's render and hl up to date before it is drawn
+struct editorRow *editorRenderRow(int filerow) {
+  struct editorRow *row = editorRowAt(filerow);
+  if (!row) return NULL;
+  if (row->flags & ROW_RENDER_STALE) editorUpdateRender(row);
+  editorUpdateSyntax(filerow);
+  return row;
+}
+
+// searching only needs render, which does not depend on other rows
+struct editorRow *editorRenderText(struct editorRow *row) {
+  if (row->flags & ROW_RENDER_STALE) editorUpdateRender(row);
+  return row;
+}
+
+// chars a save or a task may be reading are kept until they have finished
+int editorRowShared(struct editorRow *row) {
+  return (row->flags & ROW_SHARED) && conf.share.readers > 0;
+}
+
+void editorShareOrphan(void *p, size_t n) {
+  struct editorShare *sh = &conf.share;
+  if (sh->norphans == sh->cap) {
+    sh->cap = sh->cap ? sh->cap * 2 : 64;
+    sh->orphans = realloc(sh->orphans, sizeof(struct shareOrphan) * sh->cap);
+    if (!sh->orphans) die("realloc");
+  }
+  sh->orphans[sh->norphans].p = p;
+  sh->orphans[sh->norphans++].n = n;
+}
+
+// take a private copy of a row still pointing into the file mapping, or
+// whose text another thread may be reading; shared text kept inline is
+// left where it is and never written again
+void editorRowOwnChars(struct editorRow *row) {
+  int shared = editorRowShared(row);
+  if (!(row->flags & ROW_MAPPED) && !shared) return;
+  char *chars = heapAlloc(row->size + 1);
+  memcpy(chars, row->chars, row->size);
+  chars[row->size] = '\0';
+  if (shared && row->chars != row->inl) editorShareOrphan(row->chars, row->cap);
+  if (row->flags & ROW_RENDER_ALIAS) row->render = chars;
+  row->chars = chars;
+  row->cap = heapRoundUp(row->size + 1);
+  row->flags &= ~(ROW_MAPPED | ROW_SHARED);
+}
+
+// make room in chars for need bytes, moving a small row's text out of
+// line once it outgrows the space after the row. Rows grow by half again,
+// so one being typed into is seldom moved
+void editorRowReserve(struct editorRow *row, int need) {
+  if (need <= row->cap) return;
+  size_t cap = heapRoundUp(need > row->cap + row->cap / 2 ? need : row->cap + row->cap / 2);
+  if (row->chars == row->inl) {
+    char *chars = heapAlloc(cap);
+    memcpy(chars, row->chars, row->size + 1);
+    row->chars = chars;
+  } else {
+    row->chars = heapRealloc(row->chars, row->cap, cap);
+  }
+  if (row->flags & ROW_RENDER_ALIAS) row->render = row->chars;
+  row->cap = cap;
+}
+
+
+void editorInsertRow(int loc, const char *line, size_t linelen) {
+  if (loc < 0 || loc > conf.nrows) return;
+  editorJournal(J_INSERT_ROW, loc, 0, line, linelen);
+  undoRecord(U_INSERT_ROW, loc, 0, line, linelen);
+
+  int small = linelen < ROW_INLINE_MAX;
+  struct editorRow *row = heapAlloc(sizeof(struct editorRow) + (small ? ROW_INLINE_MAX : 0));
+  row->size = linelen;
+  row->cap = small ? ROW_INLINE_MAX : (int) heapRoundUp(linelen + 1);
+  row->chars = small ? row->inl : heapAlloc(linelen + 1);
+  memcpy(row->chars, line, linelen);
+  row->chars[linelen] = '\0';
+
+  row->rsize = 0;
+  row->render = NULL;
+  row->hl = NULL;
+  row->hl_in = 0;
+  row->hl_open_comment = 0;
+  row->hl_gen = 0;
+  row->flags = ROW_RENDER_STALE | ROW_HL_STALE | (small ? ROW_INLINE : 0);
+  ropeInsert(loc, row);
+  conf.nrows++; conf.dirty++;
+  editorInvalidateRow(loc);
+  editorIndexRow(loc, 0, linelen);
+
+}
+
+// length of a mapped line once its newline and trailing CRs are dropped
+int editorMapLineLen(int line) {
+  const char *start = conf.map.data + conf.map.lines[line];
+  size_t len = conf.map.lines[line + 1] - 1 - conf.map.lines[line];
+  while (len > 0 && start[len - 1] == '\r') len--;
+  return len;
+}
+
+// a row over text that outlives it, copied before it is edited
+struct editorRow *editorTextRow(char *text, int len) {
+  struct editorRow *row = heapAlloc(sizeof(struct editorRow));
+  row->size = len;
+  row->cap = 0;
+  row->chars = text;
+  row->rsize = 0;
+  row->render = NULL;
+  row->hl = NULL;
+  row->hl_in = 0;
+  row->hl_open_comment = 0;
+  row->hl_gen = 0;
+  row->flags = ROW_MAPPED | ROW_RENDER_STALE | ROW_HL_STALE;
+  return row;
+}
+
+struct editorRow *editorMapRow(int line) {
+  return editorTextRow(conf.map.data + conf.map.lines[line], editorMapLineLen(line));
+}
+
+// lazy leaves are copied straight out of the mapping without building rows
+char *editorRowsToString(size_t *buflen) {
+  size_t totlen = 0;
+  struct ropeNode *leaf;
+  int j;
+  for (leaf = ropeFirstLeaf(); leaf; leaf = leaf->next) {
+    for (j = 0; j < leaf->n; j++)
+      totlen += (leaf->lazy ? editorMapLineLen(leaf->mapline + j) :
+                              leaf->u.rows[j]->size) + 1;
+  }
+  *buflen = totlen;
+  char *buf = malloc(totlen ? totlen : 1);
+  if (!buf) return NULL;
+  char *p = buf;
+  for (leaf = ropeFirstLeaf(); leaf; leaf = leaf->next) {
+    for (j = 0; j < leaf->n; j++) {
+      if (leaf->lazy) {
+        int line = leaf->mapline + j;
+        int len = editorMapLineLen(line);
+        memcpy(p, conf.map.data + conf.map.lines[line], len);
+        p += len;
+      } else {
+        memcpy(p, leaf->u.rows[j]->chars, leaf->u.rows[j]->size);
+        p += leaf->u.rows[j]->size;
+      }
+      *p = '\n';
+      p++;
+    }
+  }
+  return buf;
+}
+
+void editorSetStatusMessage(const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(conf.statusmsg, sizeof(conf.statusmsg), fmt, ap);
+  va_end(ap);
+  conf.statusmsg_time = time(NULL);
+}
+
+
+// the line starts of a mapped file are found by cutting it into one piece
+// per core and scanning them side by side, twice: once counting newlines,
+// which says where each piece's starts go, and once writing them there
+#define MAP_SCAN_MIN (8 << 20)          // bytes below which a piece isn't worth a thread
+
+struct mapScan {
+  pthread_t thread;
+  const char *data;
+  size_t from, to;
+  size_t count;
+  size_t *out;                    // NULL while counting
+};
+
+#ifdef __SSE2__
+// a bit for each newline among 64 bytes
+unsigned long long mapNewlineMask(const char *p) {
+  __m128i nl = _mm_set1_epi8('\n');
+  unsigned long long m0 = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) p), nl));
+  unsigned long long m1 = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p + 16)), nl));
+  unsigned long long m2 = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p + 32)), nl));
+  unsigned long long m3 = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p + 48)), nl));
+  return m0 | m1 << 16 | m2 << 32 | m3 << 48;
+}
+#endif
+
+void *mapScanThread(void *arg) {
+  struct mapScan *s = arg;
+  const char *data = s->data, *q;
+  size_t j = s->from, n = 0;
+  if (!s->out) {
+#ifdef __SSE2__
+    for (; j + 64 <= s->to; j += 64) n += __builtin_popcountll(mapNewlineMask(data + j));
+#endif
+    for (; j < s->to && (q = memchr(data + j, '\n', s->to - j)); j = q - data + 1) n++;
+    s->count = n;
+    return NULL;
+  }
+  size_t *out = s->out;
+#ifdef __SSE2__
+  for (; j + 64 <= s->to; j += 64) {
+    unsigned long long m = mapNewlineMask(data + j);
+    while (m) {
+      *out++ = j + __builtin_ctzll(m) + 1;
+      m &= m - 1;
+    }
+  }
+#endif
+  for (; j < s->to && (q = memchr(data + j, '\n', s->to - j)); j = q - data + 1)
+    *out++ = q - data + 1;
+  return NULL;
+}
+
+// the first piece is done here; a piece whose thread won't start is too
+void mapScanRun(struct mapScan *scans, int n) {
+  int started[TASK_MAX_THREADS + 1] = {0};
+  for (int k = 1; k < n; k++)
+    started[k] = pthread_create(&scans[k].thread, NULL, mapScanThread, &scans[k]) == 0;
+  mapScanThread(&scans[0]);
+  for (int k = 1; k < n; k++) {
+    if (started[k]) pthread_join(scans[k].thread, NULL);
+    else mapScanThread(&scans[k]);
+  }
+}
+
+// index the line starts of a mapped file; rows are built from it on demand
+int editorMapIndex(struct editorMap *map) {
+  struct mapScan scans[TASK_MAX_THREADS + 1];
+  int n = map->len / MAP_SCAN_MIN + 1;
+  if (n > pool.nworkers + 1) n = pool.nworkers + 1;
+  size_t step = map->len / n;
+  for (int k = 0; k < n; k++) {
+    scans[k].data = map->data;
+    scans[k].from = k * step;
+    scans[k].to = (k == n - 1) ? map->len : (k + 1) * step;
+    scans[k].out = NULL;
+  }
+  mapScanRun(scans, n);
+
+  size_t total = 1;
+  for (int k = 0; k < n; k++) total += scans[k].count;
+  if (total >= INT_MAX) return -1;
+  // room for a last line without a newline
+  map->lines = malloc(sizeof(size_t) * (total + 1));
+  if (!map->lines) return -1;
+  map->lines[0] = 0;
+  size_t at = 1;
+  for (int k = 0; k < n; k++) {
+    scans[k].out = map->lines + at;
+    at += scans[k].count;
+  }
+  mapScanRun(scans, n);
+
+  // a last line without a newline still counts, as it does for getline
+  if (map->lines[total - 1] != map->len) map->lines[total++] = map->len + 1;
+  map->nlines = total - 1;
+  return 0;
+}
+
+int editorOpenMapped(int fd, size_t len) {
+  struct editorMap map;
+  map.len = len;
+  map.data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map.data == MAP_FAILED) return -1;
+  if (editorMapIndex(&map) == -1) {
+    free(map.lines);
+    munmap(map.data, len);
+    return -1;
+  }
+  conf.map = map;
+  ropeBuildLazy(map.nlines);
+  conf.nrows = map.nlines;
+  return 0;
+}
+
+void editorOpen(char* filename) {
+  free(conf.filename);
+  conf.filename = strdup(filename);
+
+  editorSelectSyntaxHighlight();
+
+  // regular files are mapped and split into rows only as they are touched
+  int fd = open(filename, O_RDONLY);
+  if (fd != -1) {
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+        editorOpenMapped(fd, st.st_size) == 0) {
+      close(fd);
+      conf.dirty = 0;
+      editorIndexStart(st.st_size);
+      editorJournalRecover();
+      return;
+    }
+    close(fd);
+  }
+
+  FILE *fp = fopen(filename, "r");
+  if (!fp) die("fopen");
+
+  // read from the file; the text goes in one arena rather than a block
+  // per row, and is treated like mapped text
+  char *line = NULL;
+  size_t linecap = 0;
+  ssize_t linelen;
+  while ((linelen = getline(&line, &linecap, fp)) != -1) {
+    while (linelen > 0 && (line[linelen - 1] == '\n' ||
+                           line[linelen - 1] == '\r'))  linelen--;
+    ropeInsert(conf.nrows, editorTextRow(heapText(line, linelen), linelen));
+    conf.nrows++;
+  }
+  free(line);
+  fclose(fp);
+  conf.dirty = 0;
+  editorIndexStart(0);
+  editorJournalRecover();
+}
+
+// write(2) may stop short on large buffers, so keep going until done
+int editorWriteAll(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/*** save ***/
+
+// a save takes a snapshot of the buffer as a list of spans pointing at row
+// text and at runs of the file mapping, which a writer thread streams to a
+// temporary file with writev, syncs and renames over the original. Editing
+// goes on meanwhile: rows in the snapshot copy their text before changing
+// it, and what they drop is freed once the writer is done.
+#define SAVE_IOV_SPANS 512
+
+void saveAddSpan(struct saveJob *job, const char *p, size_t len) {
+  if (job->nspans == job->cap) {
+    job->cap = job->cap ? job->cap * 2 : 1024;
+    job->spans = realloc(job->spans, sizeof(struct saveSpan) * job->cap);
+    if (!job->spans) die("realloc");
+  }
+  job->spans[job->nspans].p = p;
+  job->spans[job->nspans].len = len;
+  job->nspans++;
+  job->bytes += len + 1;
+}
+
+// lines of the mapping go out as they are, in as few spans as the carriage
+// returns dropped from line ends allow
+void saveAddMapped(struct saveJob *job, int line, int n) {
+  size_t *lines = conf.map.lines;
+  int start = line;
+  for (int l = line; l < line + n; l++) {
+    int len = editorMapLineLen(l);
+    if (l == line + n - 1 || (size_t) len != lines[l + 1] - 1 - lines[l]) {
+      saveAddSpan(job, conf.map.data + lines[start], lines[l] + len - lines[start]);
+      start = l + 1;
+    }
+  }
+}
+
+void editorSaveSnapshot(struct saveJob *job) {
+  job->nspans = job->bytes = 0;
+  for (struct ropeNode *leaf = ropeFirstLeaf(); leaf; leaf = leaf->next) {
+    if (leaf->lazy) {
+      // neighbouring lazy leaves are usually one stretch of the mapping
+      int n = leaf->n;
+      while (leaf->next && leaf->next->lazy &&
+             leaf->next->mapline == leaf->mapline + n) {
+        leaf = leaf->next;
+        n += leaf->n;
+      }
+      if (n) saveAddMapped(job, leaf->mapline + leaf->n - n, n);
+      continue;
+    }
+    for (int j = 0; j < leaf->n; j++) {
+      struct editorRow *row = leaf->u.rows[j];
+      if (!(row->flags & ROW_MAPPED)) row->flags |= ROW_SHARED;
+      saveAddSpan(job, row->chars, row->size);
+    }
+  }
+}
+
+int saveWriteSpans(int fd, struct saveJob *job) {
+  static char newline = '\n';
+  struct iovec iov[SAVE_IOV_SPANS * 2];
+  for (size_t s = 0; s < job->nspans; ) {
+    int n = 0;
+    for (; s < job->nspans && n < SAVE_IOV_SPANS * 2; s++) {
+      iov[n].iov_base = (void *) job->spans[s].p;
+      iov[n++].iov_len = job->spans[s].len;
+      iov[n].iov_base = &newline;
+      iov[n++].iov_len = 1;
+    }
+    // writev(2) may stop short too; carry on from where it did
+    struct iovec *v = iov;
+    while (n > 0) {
+      ssize_t w = writev(fd, v, n > IOV_MAX ? IOV_MAX : n);
+      if (w == -1) {
+        if (errno == EINTR) continue;
+        return -1;
+      }
+      while (n > 0 && (size_t) w >= v->iov_len) {
+        w -= v->iov_len;
+        v++;
+        n--;
+      }
+      if (n > 0) {
+        v->iov_base = (char *) v->iov_base + w;
+        v->iov_len -= w;
+      }
+    }
+  }
+  return 0;
+}
+
+// flush the rename itself to disk; a failure here is not worth reporting
+void saveSyncDir(const char *path) {
+  char *dir = strdup(path);
+  if (!dir) return;
+  char *slash = strrchr(dir, '/');
+  if (slash) *(slash == dir ? slash + 1 : slash) = '\0';
+  int fd = open(slash ? dir : ".", O_RDONLY);
+  if (fd != -1) {
+    fsync(fd);
+    close(fd);
+  }
+  free(dir);
+}
+
+void *editorSaveThread(void *arg) {
+  struct saveJob *job = arg;
+  char *tmpname = malloc(strlen(job->path) + 16);
+  int fd = -1;
+  job->err = 0;
+  if (tmpname) {
+    sprintf(tmpname, "%s.zuma~XXXXXX", job->path);
+    fd = mkstemp(tmpname);
+  } else {
+    job->err = ENOMEM;
+  }
+  if (fd != -1) {
+    if (fchmod(fd, job->mode) == -1 || saveWriteSpans(fd, job) == -1 ||
+        fsync(fd) == -1) {
+      job->err = errno;
+      close(fd);
+    } else if (close(fd) == -1 || rename(tmpname, job->path) == -1) {
+      job->err = errno;
+    } else {
+      saveSyncDir(job->path);
+    }
+    if (job->err) unlink(tmpname);
+  } else if (!job->err) {
+    job->err = errno;
+  }
+  free(tmpname);
+  __atomic_store_n(&job->done, 1, __ATOMIC_RELEASE);
+  editorWake(EVENT_TASK);
+  return NULL;
+}
+
+// reap a finished save; with wait set, block until it is
+void editorSavePoll(int wait) {
+  struct saveJob *job = &conf.save;
+  if (!job->running) return;
+  if (!wait && !__atomic_load_n(&job->done, __ATOMIC_ACQUIRE)) return;
+  pthread_join(job->thread, NULL);
+  job->running = 0;
+  editorShareRelease();
+  if (job->err) {
+    editorSetStatusMessage("I/O error: %s", strerror(job->err));
+    // autosave tries again after another quiet spell, not on every pass
+    conf.edit_time = time(NULL);
+  } else {
+    conf.dirty -= job->dirty;
+    editorJournalCompact(job->journal_off);
+    editorSetStatusMessage("%zu bytes written to disk", job->bytes);
+  }
+}
+
+void editorSave() {
+  struct saveJob *job = &conf.save;
+  if (job->running) {
+    editorSetStatusMessage("Still saving, try again in a moment");
+    return;
+  }
+  if (!conf.filename) {
+    conf.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
+    if (!conf.filename) return;
+  }
+  editorSelectSyntaxHighlight();
+
+  // write through a symlink rather than replacing it, keeping the mode
+  free(job->path);
+  job->path = realpath(conf.filename, NULL);
+  if (!job->path) job->path = strdup(conf.filename);
+  if (!job->path) die("strdup");
+  struct stat st;
+  if (stat(job->path, &st) == 0) {
+    job->mode = st.st_mode & 07777;
+  } else {
+    mode_t mask = umask(0);
+    umask(mask);
+    job->mode = 0666 & ~mask;
+  }
+
+  editorJournalCommit();
+  job->journal_off = conf.journal.size;
+  editorSaveSnapshot(job);
+  job->dirty = conf.dirty;
+  job->done = 0;
+  editorShareAcquire();
+  int err = pthread_create(&job->thread, NULL, editorSaveThread, job);
+  if (err != 0) {
+    editorShareRelease();
+    editorSetStatusMessage("Can't start saving: %s", strerror(err));
+    // autosave tries again after another quiet spell, not on every pass
+    conf.edit_time = time(NULL);
+    return;
+  }
+  job->running = 1;
+  editorSetStatusMessage("Saving %zu bytes...", job->bytes);
+}
+
+
+/*** journal ***/
+
+// every edit is also logged to a journal beside the file, so a crash loses
+// at most the last moments of work. Records gather in memory and go out
+// together, with one fdatasync, whenever typing pauses. Opening a file
+// replays a journal that was made against it. A finished save covers the
+// records made before its snapshot, and the journal is rewritten without
+// them, or removed when none are left.
+#define JOURNAL_MAGIC "ZUMAJNL1"
+#define JOURNAL_HEADER 40
+#define JOURNAL_RECORD 17               // op, row, arg, len and checksum
+#define JOURNAL_FLUSH_BYTES (1 << 20)   // written early past this, unsynced
+
+void editorRowInsertChar(int filerow, int at, int c);
+void editorRowDelChar(int filerow, int loc);
+void editorDelRow(int loc);
+void editorRowAppendString(int filerow, char *s, size_t len);
+void editorRowTruncate(int filerow, int size);
+void editorRowInsertString(int filerow, int at, const char *s, int len);
+void editorRowDelString(int filerow, int at, int len);
+
+// .name.zuma-journal in the directory of filename
+char *journalPath(const char *filename) {
+  char *path = malloc(strlen(filename) + 32);
+  if (!path) die("malloc");
+  const char *base = strrchr(filename, '/');
+  base = base ? base + 1 : filename;
+  sprintf(path, "%.*s.%s.zuma-journal", (int) (base - filename), filename, base);
+  return path;
+}
+
+void journalPut(char *p, unsigned long long v, int bytes) {
+  for (int j = 0; j < bytes; j++) p[j] = v >> (8 * j);
+}
+
+unsigned long long journalGet(const char *p, int bytes) {
+  unsigned long long v = 0;
+  for (int j = 0; j < bytes; j++) v |= (unsigned long long) (unsigned char) p[j] << (8 * j);
+  return v;
+}
+
+unsigned journalChecksum(const char *p, size_t len) {
+  unsigned h = 2166136261u;
+  for (size_t j = 0; j < len; j++) h = (h ^ (unsigned char) p[j]) * 16777619u;
+  return h;
+}
+
+// the journal starts by naming the exact file its records apply to
+void journalHeader(char *h, struct stat *st) {
+  memcpy(h, JOURNAL_MAGIC, 8);
+  journalPut(h + 8, st->st_size, 8);
+  journalPut(h + 16, st->st_mtim.tv_sec, 8);
+  journalPut(h + 24, st->st_mtim.tv_nsec, 8);
+  journalPut(h + 32, st->st_ino, 8);
+}
+
+void editorJournal(int op, int row, int arg, const char *data, int len) {
+  struct editorJournal *j = &conf.journal;
+  if (!j->enabled) return;
+  size_t need = j->len + JOURNAL_RECORD + len;
+  if (need > j->cap) {
+    j->cap = j->cap ? j->cap * 2 : 4096;
+    while (j->cap < need) j->cap *= 2;
+    j->buf = realloc(j->buf, j->cap);
+    if (!j->buf) die("realloc");
+  }
+  char *p = j->buf + j->len;
+  p[0] = op;
+  journalPut(p + 1, row, 4);
+  journalPut(p + 5, arg, 4);
+  journalPut(p + 9, len, 4);
+  if (len) memcpy(p + 13, data, len);
+  journalPut(p + 13 + len, journalChecksum(p, 13 + len), 4);
+  j->len = need;
+  if (j->len >= JOURNAL_FLUSH_BYTES) editorJournalWrite();
+}
+
+int journalCreate() {
+  struct editorJournal *j = &conf.journal;
+  char h[JOURNAL_HEADER];
+  journalHeader(h, &j->base);
+  j->fd = open(j->path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (j->fd == -1) return -1;
+  if (editorWriteAll(j->fd, h, sizeof(h)) == -1) {
+    close(j->fd);
+    j->fd = -1;
+    return -1;
+  }
+  j->size = sizeof(h);
+  return 0;
+}
+
+// hand buffered records to the kernel; editorJournalCommit makes them durable
+int editorJournalWrite() {
+  struct editorJournal *j = &conf.journal;
+  if (j->len == 0) return 0;
+  if (j->fd == -1 && journalCreate() == -1) return -1;
+  if (editorWriteAll(j->fd, j->buf, j->len) == -1) return -1;
+  j->size += j->len;
+  j->len = 0;
+  return 0;
+}
+
+void editorJournalCommit() {
+  struct editorJournal *j = &conf.journal;
+  if (!j->enabled || (j->len == 0 && j->fd == -1)) return;
+  int pending = j->len > 0;
+  if (editorJournalWrite() == -1) {
+    // what wasn't written is dropped too, or the commit timer stays armed
+    j->enabled = 0;
+    j->len = 0;
+    editorSetStatusMessage("Journal off: %s", strerror(errno));
+    return;
+  }
+  if (pending) fdatasync(j->fd);
+}
+
+// apply one record, refusing anything that doesn't fit the buffer
+int journalApply(int op, int row, int arg, char *data, int len) {
+  struct editorRow *r = (row >= 0 && row < conf.nrows) ? editorRowAt(row) : NULL;
+  switch (op) {
+    case J_INSERT_CHAR:
+      if (!r || arg > r->size || len != 1) return -1;
+      editorRowInsertChar(row, arg, (unsigned char) data[0]);
+      return 0;
+    case J_DELETE_CHAR:
+      if (!r || arg >= r->size) return -1;
+      editorRowDelChar(row, arg);
+      return 0;
+    case J_INSERT_ROW:
+      if (row < 0 || row > conf.nrows) return -1;
+      editorInsertRow(row, data, len);
+      return 0;
+    case J_DELETE_ROW:
+      if (!r) return -1;
+      editorDelRow(row);
+      return 0;
+    case J_APPEND:
+      if (!r) return -1;
+      editorRowAppendString(row, data, len);
+      return 0;
+    case J_TRUNCATE:
+      if (!r || arg > r->size) return -1;
+      editorRowTruncate(row, arg);
+      return 0;
+    case J_INSERT_TEXT:
+      if (!r || arg > r->size) return -1;
+      editorRowInsertString(row, arg, data, len);
+      return 0;
+    case J_DELETE_TEXT:
+      if (!r || arg + (long long) len > r->size) return -1;
+      editorRowDelString(row, arg, len);
+      return 0;
+  }
+  return -1;
+}
+
+// replay the journal left behind for the file just opened, then keep
+// logging to it; a torn record at its end is where the crash came
+void editorJournalRecover() {
+  struct editorJournal *j = &conf.journal;
+  free(j->path);
+  j->path = journalPath(conf.filename);
+  j->fd = -1;
+  j->size = 0;
+  j->len = 0;
+  j->enabled = 0;
+  // a replay neither recovers nor leaves a journal
+  if (editorReplaying()) return;
+  if (stat(conf.filename, &j->base) == -1) return;
+
+  int fd = open(j->path, O_RDWR);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1 || st.st_size < JOURNAL_HEADER) {
+    if (fd != -1) close(fd);
+    j->enabled = 1;
+    return;
+  }
+  char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  char h[JOURNAL_HEADER];
+  journalHeader(h, &j->base);
+  if (data == MAP_FAILED || memcmp(data, h, JOURNAL_HEADER) != 0) {
+    if (data != MAP_FAILED) munmap(data, st.st_size);
+    close(fd);
+    editorSetStatusMessage("Ignoring %s, the file changed since", j->path);
+    j->enabled = 1;
+    return;
+  }
+  off_t off = JOURNAL_HEADER;
+  int edits = 0;
+  while (st.st_size - off >= JOURNAL_RECORD) {
+    char *p = data + off;
+    int len = journalGet(p + 9, 4);
+    if (len < 0 || st.st_size - off - JOURNAL_RECORD < len) break;
+    if (journalGet(p + 13 + len, 4) != journalChecksum(p, 13 + len)) break;
+    if (journalApply(p[0], journalGet(p + 1, 4), journalGet(p + 5, 4), p + 13, len) == -1)
+      break;
+    off += JOURNAL_RECORD + len;
+    edits++;
+  }
+  munmap(data, st.st_size);
+  if (off < st.st_size) ftruncate(fd, off);
+  lseek(fd, off, SEEK_SET);
+  j->fd = fd;
+  j->size = off;
+  j->enabled = 1;
+  if (edits) editorSetStatusMessage("Recovered %d edits from %s", edits, j->path);
+}
+
+// a save has written everything up to journal offset from; start a fresh
+// journal against the saved file holding only what came after
+void editorJournalCompact(off_t from) {
+  struct editorJournal *j = &conf.journal;
+  if (!j->enabled) return;
+  char *old = j->path;
+  j->path = journalPath(conf.filename);
+  size_t tail = (j->fd != -1 && j->size > from) ? j->size - from : 0;
+  char *keep = malloc(tail + j->len + 1);
+  if (!keep) die("malloc");
+  if (tail && pread(j->fd, keep, tail, from) != (ssize_t) tail) tail = 0;
+  memcpy(keep + tail, j->buf, j->len);
+  size_t len = tail + j->len;
+
+  if (j->fd != -1) close(j->fd);
+  unlink(old);
+  free(old);
+  j->fd = -1;
+  j->size = 0;
+  j->len = 0;
+  if (stat(conf.filename, &j->base) == -1) j->enabled = 0;
+  if (len && j->enabled) {
+    if (journalCreate() == 0 && editorWriteAll(j->fd, keep, len) == 0) {
+      j->size += len;
+      fdatasync(j->fd);
+    }
+  }
+  free(keep);
+}
+
+// leaving normally means any unsaved edits were given up on purpose
+void editorJournalClose() {
+  struct editorJournal *j = &conf.journal;
+  if (j->fd != -1) close(j->fd);
+  if (j->path) unlink(j->path);
+  j->fd = -1;
+  j->len = 0;
+  j->enabled = 0;
+}
+
+/*** search ***/
+
+// first occurrence of needle in hay; candidates have to agree on both the
+// first and the last byte of the needle before they are compared in full
+const char *searchMem(const char *hay, size_t hlen, const char *needle, size_t nlen) {
+  if (nlen == 0) return hay;
+  if (hlen < nlen) return NULL;
+  const char *p = hay;
+  const char *end = hay + hlen - nlen + 1;   // last candidate start + 1
+#ifdef __SSE2__
+  __m128i first = _mm_set1_epi8(needle[0]);
+  __m128i last = _mm_set1_epi8(needle[nlen - 1]);
+  for (; end - p >= 16; p += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *) p);
+    __m128i b = _mm_loadu_si128((const __m128i *) (p + nlen - 1));
+    unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+                                                    _mm_cmpeq_epi8(b, last)));
+    while (mask) {
+      int bit = __builtin_ctz(mask);
+      if (memcmp(p + bit, needle, nlen) == 0) return p + bit;
+      mask &= mask - 1;
+    }
+  }
+#endif
+  while (p < end) {
+    p = memchr(p, needle[0], end - p);
+    if (!p) return NULL;
+    if (p[nlen - 1] == needle[nlen - 1] && memcmp(p, needle, nlen) == 0) return p;
+    p++;
+  }
+  return NULL;
+}
+
+// the text of a row without building it when its leaf is still lazy
+const char *editorLeafText(struct ropeNode *leaf, int slot, int *len) {
+  if (leaf->lazy) {
+    int line = leaf->mapline + slot;
+    *len = editorMapLineLen(line);
+    return conf.map.data + conf.map.lines[line];
+  }
+  *len = leaf->u.rows[slot]->size;
+  return leaf->u.rows[slot]->chars;
+}
+
+const char *editorRowText(int at, int *len) {
+  int slot;
+  struct ropeNode *leaf = ropeFindLeaf(at, &slot);
+  return leaf ? editorLeafText(leaf, slot, len) : NULL;
+}
+
+void editorSearchAdd(int row, int col, int len) {
+  struct editorSearch *s = &conf.search;
+  if (s->nmatches == s->cap) {
+    int cap = s->cap ? s->cap * 2 : 64;
+    struct searchMatch *m = realloc(s->matches, sizeof(struct searchMatch) * cap);
+    if (!m) die("realloc");
+    s->matches = m;
+    s->cap = cap;
+  }
+  s->matches[s->nmatches].row = row;
+  s->matches[s->nmatches].col = col;
+  s->matches[s->nmatches].len = len;
+  s->nmatches++;
+}
+
+// go to the next or previous match and mark it for drawing
+void editorSearchStep(int direction) {
+  struct editorSearch *s = &conf.search;
+  // an empty query matches the start of every row without listing them
+  int n = (s->query && s->qlen == 0) ? conf.nrows : s->nmatches;
+  if (n == 0) return;
+  if (s->current == -1) s->current = 0;
+  else s->current = (s->current + direction + n) % n;
+
+  struct searchMatch m = {s->current, 0, 0};
+  if (s->qlen > 0) m = s->matches[s->current];
+  conf.cy = m.row;
+  conf.cx = m.col;
+  conf.rowoff = conf.nrows;
+  s->hl_row = m.row;
+  s->hl_col = m.col;
+  s->hl_len = m.len;
+}
+
+// a scan of the buffer is cut into chunks of a snapshot, each finding its
+// own matches on the task pool; they join the list in order as they come
+#define SEARCH_CHUNK_BYTES (1 << 20)
+
+struct searchChunk {
+  struct task t;                  // first, so a task is its chunk
+  struct searchJob *job;
+  int first, last;                // spans of the snapshot
+  int finished;
+  const char *err;                // why the pattern didn't compile
+  struct searchMatch *matches;
+  int n, cap;
+};
+
+struct searchJob {
+  int cancelled;
+  int async;                      // chunks went to the pool
+  struct snapshot *snap;
+  char *query;
+  int qlen;
+  int regex;
+  struct searchChunk *chunks;
+  int nchunks, merged, outstanding;
+};
+
+void searchChunkAdd(struct searchChunk *c, int row, int col, int len) {
+  if (c->n == c->cap) {
+    c->cap = c->cap ? c->cap * 2 : 64;
+    c->matches = realloc(c->matches, sizeof(struct searchMatch) * c->cap);
+    if (!c->matches) die("realloc");
+  }
+  c->matches[c->n].row = row;
+  c->matches[c->n].col = col;
+  c->matches[c->n].len = len;
+  c->n++;
+}
+
+// scan n consecutive mapped lines, starting at file row at, as one block of
+// text; hits are placed on their line by bisecting the line index
+void searchMapped(struct searchChunk *c, int line, int n, int at, const char *q, int qlen) {
+  size_t *lines = conf.map.lines;
+  size_t pos = lines[line];
+  size_t end = lines[line + n] > conf.map.len ? conf.map.len : lines[line + n];
+  int l = line;
+  while (pos < end) {
+    const char *hit = searchMem(conf.map.data + pos, end - pos, q, qlen);
+    if (!hit) break;
+    size_t off = hit - conf.map.data;
+    int lo = l, hi = line + n - 1;
+    while (lo < hi) {
+      int mid = lo + (hi - lo + 1) / 2;
+      if (lines[mid] <= off) lo = mid;
+      else hi = mid - 1;
+    }
+    l = lo;
+    // a hit running over the end of its line is not a match
+    if (off + qlen <= lines[l] + editorMapLineLen(l)) {
+      searchChunkAdd(c, at + l - line, off - lines[l], qlen);
+      pos = lines[l + 1];
+    } else {
+      pos = off + 1;
+    }
+  }
+}
+
+// patterns have no literal text to run over whole spans, so each row is
+// handed to the DFA in turn; a DFA fills in as it runs, so every chunk
+// compiles its own
+void searchChunkRun(struct task *t) {
+  struct searchChunk *c = (struct searchChunk *) t;
+  struct searchJob *job = c->job;
+  struct snapSpan *spans = job->snap->spans;
+  struct regex *re = NULL;
+  if (job->regex && !(re = regexCompile(job->query, &c->err))) return;
+  for (int s = c->first; s < c->last && !taskCancelled(t); s++) {
+    struct snapSpan *sp = &spans[s];
+    if (re) {
+      for (int j = 0; j < sp->n; j++) {
+        int len, start, end;
+        const char *text = snapRowText(sp, j, &len);
+        if (regexSearch(re, text, len, &start, &end))
+          searchChunkAdd(c, sp->row + j, start, end - start);
+      }
+    } else if (sp->line >= 0) {
+      // neighbouring lazy leaves are usually one stretch of the mapping
+      int n = sp->n;
+      while (s + 1 < c->last && spans[s + 1].line == sp->line + n &&
+             spans[s + 1].row == sp->row + n)
+        n += spans[++s].n;
+      searchMapped(c, sp->line, n, sp->row, job->query, job->qlen);
+    } else {
+      const char *hit = searchMem(sp->p, sp->len, job->query, job->qlen);
+      if (hit) searchChunkAdd(c, sp->row, hit - sp->p, job->qlen);
+    }
+  }
+  regexFree(re);
+}
+
+void searchJobFree(struct searchJob *job) {
+  snapshotFree(job->snap);
+  for (int k = 0; k < job->nchunks; k++) free(job->chunks[k].matches);
+  free(job->chunks);
+  free(job->query);
+  free(job);
+}
+
+void searchChunkDone(struct task *t) {
+  struct searchChunk *c = (struct searchChunk *) t;
+  struct searchJob *job = c->job;
+  struct editorSearch *s = &conf.search;
+  c->finished = 1;
+  job->outstanding--;
+  if (c->err && !job->cancelled) editorSetStatusMessage("Regex error: %s", c->err);
+  while (!job->cancelled && job->merged < job->nchunks &&
+         job->chunks[job->merged].finished) {
+    struct searchChunk *m = &job->chunks[job->merged++];
+    for (int j = 0; j < m->n; j++)
+      editorSearchAdd(m->matches[j].row, m->matches[j].col, m->matches[j].len);
+    free(m->matches);
+    m->matches = NULL;
+  }
+  // the prompt is taken to the first match as soon as there is one
+  if (!job->cancelled && job->async && s->current == -1 && s->nmatches > 0)
+    editorSearchStep(1);
+  if (job->outstanding > 0) return;
+  if (s->job == job) s->job = NULL;
+  searchJobFree(job);
+}
+
+void editorSearchCancel() {
+  struct editorSearch *s = &conf.search;
+  if (!s->job) return;
+  taskCancel(&s->job->cancelled);
+  s->job = NULL;
+}
+
+// find every row holding the query, passing over leaves whose filter
+// rules it out; a buffer scanned in a blink is not worth the pool
+void editorSearchStart(const char *q, int qlen, int regex) {
+  int ntri = (!regex && conf.index.enabled && qlen >= 3) ? qlen - 2 : 0;
+  unsigned *tri = malloc(sizeof(unsigned) * (ntri ? ntri : 1));
+  if (!tri) ntri = 0;
+  for (int j = 0; j < ntri; j++) tri[j] = indexHash((const unsigned char *) q + j);
+
+  struct searchJob *job = calloc(1, sizeof(struct searchJob));
+  if (!job || !(job->query = strdup(q))) die("calloc");
+  job->qlen = qlen;
+  job->regex = regex;
+  job->snap = snapshotNew();
+  int at = 0;
+  for (struct ropeNode *leaf = ropeFirstLeaf(); leaf; leaf = leaf->next) {
+    if (indexMayHold(leaf, tri, ntri)) snapshotAddLeaf(job->snap, leaf, 0, at);
+    at += leaf->n;
+  }
+  free(tri);
+
+  int *starts;
+  int n = snapshotSplit(job->snap, SEARCH_CHUNK_BYTES, &starts);
+  struct searchChunk *chunks = calloc(n ? n : 1, sizeof(struct searchChunk));
+  if (!chunks) die("calloc");
+  for (int k = 0; k < n; k++) {
+    chunks[k].t.run = searchChunkRun;
+    chunks[k].t.done = searchChunkDone;
+    chunks[k].t.cancel = &job->cancelled;
+    chunks[k].job = job;
+    chunks[k].first = starts[k];
+    chunks[k].last = starts[k + 1];
+  }
+  free(starts);
+  job->chunks = chunks;
+  job->nchunks = job->outstanding = n;
+  if (n == 0) {
+    searchJobFree(job);
+    return;
+  }
+  job->async = pool.nworkers > 0 && n > 1;
+  if (!job->async) {
+    // the last chunk done frees the job
+    for (int k = 0; k < n; k++) {
+      chunks[k].t.run(&chunks[k].t);
+      chunks[k].t.done(&chunks[k].t);
+    }
+    return;
+  }
+  conf.search.job = job;
+  for (int k = 0; k < n; k++) editorTaskSubmit(&chunks[k].t, TASK_HIGH);
+}
+
+// a longer query can only match rows the shorter one did, and no earlier
+// in the row, so typing into the prompt narrows the list already found
+void editorSearchNarrow(const char *q, int qlen) {
+  struct editorSearch *s = &conf.search;
+  int kept = 0;
+  for (int j = 0; j < s->nmatches; j++) {
+    struct searchMatch m = s->matches[j];
+    int len;
+    const char *text = editorRowText(m.row, &len);
+    // a match on a row that is gone is dropped
+    if (!text) continue;
+    const char *hit = searchMem(text + m.col, len - m.col, q, qlen);
+    if (hit) {
+      s->matches[kept].row = m.row;
+      s->matches[kept].col = hit - text;
+      s->matches[kept].len = qlen;
+      kept++;
+    }
+  }
+  s->nmatches = kept;
+}
+
+void editorSearchRun(const char *query) {
+  struct editorSearch *s = &conf.search;
+  int qlen = strlen(query);
+  if (s->query && strcmp(s->query, query) == 0) return;
+  // only a finished list can be narrowed
+  int narrow = !s->regex && !s->job && s->query && s->qlen > 0 &&
+               qlen > s->qlen && memcmp(query, s->query, s->qlen) == 0;
+  free(s->query);
+  s->query = strdup(query);
+  s->qlen = qlen;
+  s->current = -1;
+  if (narrow) {
+    editorSearchNarrow(query, qlen);
+    return;
+  }
+  editorSearchCancel();
+  s->nmatches = 0;
+  if (s->regex) {
+    // a longer pattern may match more, so every change is a fresh scan
+    regexFree(s->re);
+    const char *err = NULL;
+    s->re = (qlen > 0) ? regexCompile(query, &err) : NULL;
+    if (s->re) editorSearchStart(query, qlen, 1);
+    else if (err) editorSetStatusMessage("Regex: %s (%s)", query, err);
+  } else if (qlen > 0) {
+    editorSearchStart(query, qlen, 0);
+  }
+}
+
+void editorSearchReset() {
+  struct editorSearch *s = &conf.search;
+  editorSearchCancel();
+  free(s->query);
+  free(s->matches);
+  regexFree(s->re);
+  s->query = NULL;
+  s->matches = NULL;
+  s->re = NULL;
+  s->nmatches = s->cap = 0;
+  s->current = -1;
+  s->hl_row = -1;
+}
+
+void editorFindCallback(char *query, int key) {
+  struct editorSearch *s = &conf.search;
+  s->hl_row = -1;
+
+  int direction = 1;
+  if (key == '\r' || key == '\x1b') {
+    editorSearchReset();
+    return;
+  } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+    direction = 1;
+  } else if (key == ARROW_LEFT || key == ARROW_UP) {
+    direction = -1;
+  } else {
+    editorSearchRun(query);
+  }
+  editorSearchStep(direction);
+}
+
+void editorFind(int regex) {
+  int saved_cx = conf.cx;
+  int saved_cy = conf.cy;
+  int saved_coloff = conf.coloff;
+  int saved_rowoff = conf.rowoff;
+  conf.search.regex = regex;
+  char *query = editorPrompt(regex ? "Regex: %s (Esc/Enter/Arrows)" :
+                                     "Search: %s (Esc/Enter/Arrows)",
+                              editorFindCallback);
+  if (!query) {
+    conf.cx = saved_cx;
+    conf.cy = saved_cy;
+    conf.coloff = saved_coloff;
+    conf.rowoff = saved_rowoff;
+  return;
+}
+  free(query);
+}
+
+// disable raw mode at exit
+void disableRawMode(){
+  write(STDOUT_FILENO, "\x1b[?2004l", 8);
+  if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &(conf.orig_termios)) == -1)
+    die("tcsetattr");
+}
+
+// turn off echoing and canonical mode
+void enableRawMode(){
+  if (tcgetattr(STDIN_FILENO, &(conf.orig_termios)) == -1) die("tcgetattr");
+  atexit(disableRawMode);
+
+  struct termios raw = (conf.orig_termios);
+
+  // fix Ctrl-M and disable Ctrl-S, Ctrl-Q, and other miscellaneous flags
+  raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+  // turn off all output processing
+  raw.c_oflag &= ~(OPOST);
+  raw.c_cflag |= (CS8);
+  // disable Ctrl-C, Ctrl-Z, and Ctrl-V
+  raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+  // reads never block; waiting for input is done in poll
+  raw.c_cc[VMIN] = 0;
+  raw.c_cc[VTIME] = 0;
+
+  if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr");
+  // have pastes marked so they can go in whole
+  write(STDOUT_FILENO, "\x1b[?2004h", 8);
+}
+
+int getCursorPosition(int *n_row, int *n_col) {
+  char buf[32];
+  unsigned int i = 0;
+  if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) return -1;
+  while (i < sizeof(buf) - 1) {
+    if (!inputWait(INPUT_SEQ_TIMEOUT) || read(STDIN_FILENO, &buf[i], 1) != 1) break;
+    if (buf[i] == 'R') break;
+    i++;
+  }
+  buf[i] = '\0';
+  if (buf[0] != '\x1b' || buf[1] != '[') return -1;
+  if (sscanf(&buf[2], "%d;%d", n_row, n_col) != 2) return -1;
+  return 0;
+}
+
+// window resize
+int getWindowSize(int *n_row, int *n_col) {
+  struct winsize ws;
+
+  if (editorReplaying()) {
+    *n_row = conf.replay.rows;
+    *n_col = conf.replay.cols;
+    return 0;
+  }
+
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
+    if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12) return -1;
+    return getCursorPosition(n_row, n_col);
+    // editorReadKey();
+    // return -1;
+  } else {
+    *n_col = ws.ws_col;
+    *n_row = ws.ws_row;
+    return 0;
+  }
+}
+
+
+// syntax files named in ZUMA_SYNTAX, separated by colons, or else
+// ~/.zumasyntax if there is one
+void editorLoadSyntax() {
+  char *env = getenv("ZUMA_SYNTAX");
+  char *paths;
+  if (env) {
+    paths = strdup(env);
+  } else {
+    char *home = getenv("HOME");
+    if (!home) return;
+    paths = malloc(strlen(home) + 16);
+    if (paths) sprintf(paths, "%s/.zumasyntax", home);
+    if (paths && access(paths, R_OK) != 0) *paths = '\0';
+  }
+  if (!paths) die("malloc");
+  for (char *path = strtok(paths, ":"); path; path = strtok(NULL, ":")) {
+    const char *err;
+    int line;
+    if (syntaxLoadFile(path, &err, &line) == -1)
+      editorSetStatusMessage("%s:%d: %s", path, line, err);
+  }
+  free(paths);
+}
+
+// rows are re-highlighted lazily as they are drawn under the new syntax
+void editorSelectSyntaxHighlight() {
+  conf.syntax = syntaxSelect(conf.filename);
+  conf.hl_gen++;
+  conf.hl_frontier = 0;
+}
+
+// run the highlighter over one line, filling hl and returning whether a
+// multi-line comment is still open at its end; ZUMA_HL_STATS=1 times it
+int editorHighlightLine(const char *text, int len, unsigned char *hl, int in_comment) {
+  if (!conf.hl_stats) return syntaxHighlightLine(conf.syntax, text, len, hl, in_comment);
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  in_comment = syntaxHighlightLine(conf.syntax, text, len, hl, in_comment);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  conf.hl_bytes += len;
+  conf.hl_ns += (t1.tv_sec - t0.tv_sec) * 1000000000ULL + t1.tv_nsec - t0.tv_nsec;
+  return in_comment;
+}
+
+// rows whose colors aren't needed right now only keep their state, which
+// comes out the same from chars as from render: expanding tabs into
+// spaces never changes where strings or comments open and close
+unsigned char *editorHighlightScratch(int len) {
+  static unsigned char *scratch = NULL;
+  static int cap = 0;
+  if (len > cap) {
+    cap = len * 2;
+    scratch = realloc(scratch, cap);
+    if (!scratch) die("realloc");
+  }
+  return scratch;
+}
+
+void editorHighlightRow(struct editorRow *row, int in_comment, int keep) {
+  if (stats.enabled && row->hl_gen == conf.hl_gen &&
+      ((row->flags & ROW_HL_STALE) || row->hl_in != in_comment))
+    stats.rehighlighted++;
+  if (keep && (row->flags & ROW_RENDER_STALE)) editorUpdateRender(row);
+  if (row->flags & ROW_LONG) {
+    // only the marks are kept, and drawn from
+    row->hl_in = in_comment;
+    row->hl_open_comment = longRowGet(row)->out;
+  } else if (keep) {
+    if (!row->hl) row->hl = heapAlloc(row->rsize + 1);
+    row->hl_open_comment = editorHighlightLine(row->render, row->rsize,
+                                               row->hl, in_comment);
+  } else {
+    heapFree(row->hl, row->rsize + 1);
+    row->hl = NULL;
+    row->hl_open_comment = editorHighlightLine(row->chars, row->size,
+                                               editorHighlightScratch(row->size),
+                                               in_comment);
+  }
+  row->hl_in = in_comment;
+  row->hl_gen = conf.hl_gen;
+  row->flags &= ~ROW_HL_STALE;
+}
+
+int editorRowHlValid(struct editorRow *row) {
+  return !(row->flags & ROW_HL_STALE) && row->hl_gen == conf.hl_gen;
+}
+
+// carry the comment state over the lines of a lazy leaf without building rows
+int editorHighlightMapped(int line, int n, int in_comment) {
+  for (int j = 0; j < n; j++, line++) {
+    int len = editorMapLineLen(line);
+    in_comment = editorHighlightLine(conf.map.data + conf.map.lines[line], len,
+                                     editorHighlightScratch(len), in_comment);
+  }
+  return in_comment;
+}
+
+// the comment state flowing into slot of leaf
+int editorHighlightStateAt(struct ropeNode *leaf, int slot) {
+  if (slot > 0) return leaf->u.rows[slot - 1]->hl_open_comment;
+  struct ropeNode *prev = leaf->prev;
+  while (prev && prev->n == 0) prev = prev->prev;
+  if (!prev) return 0;
+  if (prev->lazy) return prev->hl_out;
+  return prev->u.rows[prev->n - 1]->hl_open_comment;
+}
+
+// walk the frontier down through row to, re-highlighting only rows whose
+// text changed or whose incoming state differs from their checkpoint; once
+// the state converges the rest is just compared. A positive budget caps
+// the rows visited, for idle work, and leaves lazy leaves unbuilt.
+void editorHighlightUpto(int to, int budget) {
+  if (to >= conf.nrows) to = conf.nrows - 1;
+  while (conf.hl_frontier <= to && budget != 0) {
+    int slot;
+    struct ropeNode *leaf = ropeFindLeaf(conf.hl_frontier, &slot);
+    int leafend = conf.hl_frontier - slot + leaf->n;
+    if (leaf->lazy && (slot > 0 || (budget < 0 && to < leafend)))
+      ropeMaterialize(leaf);
+    int state = editorHighlightStateAt(leaf, slot);
+
+    if (leaf->lazy) {
+      if (leaf->hl_gen != conf.hl_gen || leaf->hl_in != state) {
+        leaf->hl_out = editorHighlightMapped(leaf->mapline, leaf->n, state);
+        leaf->hl_in = state;
+        leaf->hl_gen = conf.hl_gen;
+      }
+      conf.hl_frontier = leafend;
+      if (budget > 0) budget = (budget > leaf->n) ? budget - leaf->n : 0;
+      continue;
+    }
+    for (; slot < leaf->n && conf.hl_frontier <= to && budget != 0; slot++) {
+      struct editorRow *row = leaf->u.rows[slot];
+      if (!editorRowHlValid(row) || row->hl_in != state) {
+        int visible = conf.hl_frontier >= conf.rowoff &&
+                      conf.hl_frontier < conf.rowoff + conf.screenrows;
+        editorHighlightRow(row, state, visible);
+      }
+      state = row->hl_open_comment;
+      conf.hl_frontier++;
+      if (budget > 0) budget--;
+    }
+  }
+}
+
+int editorHighlightPending() {
+  return editorSyntaxIsStateful() && conf.hl_frontier < conf.nrows;
+}
+
+// make a row's hl current for drawing
+void editorUpdateSyntax(int filerow) {
+  unsigned long long t0 = stats.enabled ? statsNow() : 0;
+  struct editorRow *row = editorRowAt(filerow);
+  if (editorSyntaxIsStateful()) {
+    editorHighlightUpto(filerow, -1);
+    if (!row->hl && !(row->flags & ROW_LONG)) editorHighlightRow(row, row->hl_in, 1);
+  } else if (!editorRowHlValid(row) || (!row->hl && !(row->flags & ROW_LONG))) {
+    editorHighlightRow(row, 0, 1);
+  }
+  if (t0) statAdd(&stats.syntax, statsNow() - t0);
+}
+
+// highlighting ahead of the viewport runs on the task pool, over chunks
+// of a snapshot from the frontier down. A chunk can't know the comment
+// state flowing into it until the chunks above are done, but as that is
+// only open or closed it lexes both ways at once, the second only until
+// the two agree, which they nearly always soon do. The UI thread then
+// walks the chunks in order, picking the answer that fits, and stores the
+// states as checkpoints.
+#define HL_CHUNK_BYTES (1 << 20)
+
+struct hlChunk {
+  struct task t;                  // first, so a task is its chunk
+  struct hlJob *job;
+  int first, last;                // spans of the snapshot
+  int row, n;                     // rows covered
+  unsigned char *out[2];          // state after each row, from closed or open
+  int converged;                  // rows until out[1] follows out[0]
+  int finished;
+  size_t bytes;
+  unsigned long long ns;
+};
+
+struct hlJob {
+  int cancelled;
+  struct snapshot *snap;
+  struct editorSyntax *syntax;
+  int gen;
+  struct hlChunk *chunks;
+  int nchunks, applied, outstanding;
+};
+
+void hlChunkRun(struct task *t) {
+  struct hlChunk *c = (struct hlChunk *) t;
+  struct snapSpan *spans = c->job->snap->spans;
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  c->out[0] = malloc(c->n ? c->n : 1);
+  c->out[1] = malloc(c->n ? c->n : 1);
+  if (!c->out[0] || !c->out[1]) die("malloc");
+  unsigned char *scratch = NULL;
+  int cap = 0;
+  int state[2] = {0, 1};
+  int both = 1;
+  int i = 0;
+  c->converged = c->n;
+  for (int s = c->first; s < c->last && !taskCancelled(t); s++) {
+    for (int j = 0; j < spans[s].n; j++, i++) {
+      int len;
+      const char *text = snapRowText(&spans[s], j, &len);
+      if (len > cap) {
+        cap = len * 2;
+        scratch = realloc(scratch, cap);
+        if (!scratch) die("realloc");
+      }
+      state[0] = syntaxHighlightLine(c->job->syntax, text, len, scratch, state[0]);
+      c->out[0][i] = state[0];
+      if (both) {
+        state[1] = syntaxHighlightLine(c->job->syntax, text, len, scratch, state[1]);
+        c->out[1][i] = state[1];
+        if (state[1] == state[0]) {
+          both = 0;
+          c->converged = i + 1;
+        }
+      }
+      c->bytes += len;
+    }
+  }
+  free(scratch);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  c->ns = (t1.tv_sec - t0.tv_sec) * 1000000000ULL + t1.tv_nsec - t0.tv_nsec;
+}
+
+// store a finished chunk's states from the frontier to its end; lazy
+// leaves only keep what flows in and out of them
+void hlChunkApply(struct hlChunk *c) {
+  int end = c->row + c->n;
+  if (conf.hl_frontier >= end) return;
+  int slot;
+  struct ropeNode *leaf = ropeFindLeaf(c->row, &slot);
+  int open = editorHighlightStateAt(leaf, slot);
+  int r = conf.hl_frontier;
+  leaf = ropeFindLeaf(r, &slot);
+  int in = editorHighlightStateAt(leaf, slot);
+#define HL_OUT(r) ((open && (r) - c->row < c->converged) ? \
+                   c->out[1][(r) - c->row] : c->out[0][(r) - c->row])
+  for (; r < end; leaf = leaf->next, slot = 0) {
+    if (leaf->lazy) {
+      r += leaf->n;
+      leaf->hl_in = in;
+      leaf->hl_out = in = HL_OUT(r - 1);
+      leaf->hl_gen = conf.hl_gen;
+      continue;
+    }
+    for (; slot < leaf->n && r < end; slot++, r++) {
+      struct editorRow *row = leaf->u.rows[slot];
+      int out = HL_OUT(r);
+      if (!editorRowHlValid(row) || row->hl_in != in) {
+        if (stats.enabled && row->hl_gen == conf.hl_gen) stats.rehighlighted++;
+        heapFree(row->hl, row->rsize + 1);
+        row->hl = NULL;
+        row->hl_in = in;
+        row->hl_open_comment = out;
+        row->hl_gen = conf.hl_gen;
+        row->flags &= ~ROW_HL_STALE;
+      }
+      in = out;
+    }
+  }
+#undef HL_OUT
+  conf.hl_frontier = end;
+}
+
+void hlJobFree(struct hlJob *job) {
+  snapshotFree(job->snap);
+  for (int k = 0; k < job->nchunks; k++) {
+    free(job->chunks[k].out[0]);
+    free(job->chunks[k].out[1]);
+  }
+  free(job->chunks);
+  free(job);
+}
+
+void editorHighlightCancel() {
+  if (!conf.hl_job) return;
+  taskCancel(&conf.hl_job->cancelled);
+  conf.hl_job = NULL;
+}
+
+void hlChunkDone(struct task *t) {
+  struct hlChunk *c = (struct hlChunk *) t;
+  struct hlJob *job = c->job;
+  c->finished = 1;
+  job->outstanding--;
+  if (conf.hl_stats) {
+    conf.hl_bytes += c->bytes;
+    conf.hl_ns += c->ns;
+  }
+  if (job == conf.hl_job &&
+      (job->snap->version != conf.version || job->gen != conf.hl_gen))
+    editorHighlightCancel();
+  while (!job->cancelled && job->applied < job->nchunks &&
+         job->chunks[job->applied].finished) {
+    struct hlChunk *a = &job->chunks[job->applied++];
+    hlChunkApply(a);
+    free(a->out[0]);
+    free(a->out[1]);
+    a->out[0] = a->out[1] = NULL;
+  }
+  if (job->outstanding > 0) return;
+  if (conf.hl_job == job) conf.hl_job = NULL;
+  hlJobFree(job);
+}
+
+void editorHighlightSubmit() {
+  struct hlJob *job = calloc(1, sizeof(struct hlJob));
+  if (!job) die("calloc");
+  job->snap = snapshotNew();
+  job->syntax = conf.syntax;
+  job->gen = conf.hl_gen;
+  int slot;
+  int at = conf.hl_frontier;
+  struct ropeNode *leaf = ropeFindLeaf(at, &slot);
+  if (leaf->lazy && slot > 0) ropeMaterialize(leaf);
+  for (; leaf; leaf = leaf->next) {
+    snapshotAddLeaf(job->snap, leaf, slot, at);
+    at += leaf->n - slot;
+    slot = 0;
+  }
+  int *starts;
+  int n = snapshotSplit(job->snap, HL_CHUNK_BYTES, &starts);
+  struct hlChunk *chunks = calloc(n ? n : 1, sizeof(struct hlChunk));
+  if (!chunks) die("calloc");
+  struct snapSpan *spans = job->snap->spans;
+  for (int k = 0; k < n; k++) {
+    chunks[k].t.run = hlChunkRun;
+    chunks[k].t.done = hlChunkDone;
+    chunks[k].t.cancel = &job->cancelled;
+    chunks[k].job = job;
+    chunks[k].first = starts[k];
+    chunks[k].last = starts[k + 1];
+    chunks[k].row = spans[starts[k]].row;
+    struct snapSpan *last = &spans[starts[k + 1] - 1];
+    chunks[k].n = last->row + last->n - chunks[k].row;
+  }
+  free(starts);
+  job->chunks = chunks;
+  job->nchunks = job->outstanding = n;
+  if (n == 0) {
+    hlJobFree(job);
+    return;
+  }
+  conf.hl_job = job;
+  for (int k = 0; k < n; k++) editorTaskSubmit(&chunks[k].t, TASK_LOW);
+}
+
+int editorSyntaxToColor(int hl) {
+  switch (hl) {
+    case HL_COMMENT: case HL_MLCOMMENT: return 36;
+    case HL_KEYWORD1: return 33;
+    case HL_KEYWORD2: return 32;
+    case HL_STRING: return 35;
+    case HL_NUMBER: return 31;
+    case HL_MATCH: return 34;
+    default: return 37;
+  }
+}
+
+// void editorSelectSyntaxHighlight() {
+//   conf.syntax = NULL;
+//   if (conf.filename == NULL) return;
+//   char *ext = strrchr(conf.filename, '.');
+//   for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
+//     struct editorSyntax *s = &HLDB[j];
+//     unsigned int i = 0;
+//     while (s->filematch[i]) {
+//       int is_ext = (s->filematch[i][0] == '.');
+//       if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
+//           (!is_ext && strstr(conf.filename, s->filematch[i]))) {
+//         conf.syntax = s;
+//
+//         int filerow;
+//         for (filerow = 0; filerow < conf.nrows; filerow++) {
+//           editorUpdateSyntax(&conf.row[filerow]);
+//         }
+//         return;
+//       }
+//       i++;
+//     }
+//   }
+// }
+
+// append buffer, grown geometrically and reused from frame to frame
+struct abuf {
+  char *b;
+  int len;
+  int cap;
+};
+
+#define ABUF_INIT {NULL, 0, 0}
+
+int abReserve(struct abuf *ab, int len) {
+  if (ab->len + len <= ab->cap) return 0;
+  int cap = ab->cap ? ab->cap : 1024;
+  while (cap < ab->len + len) cap *= 2;
+  char *new = realloc(ab->b, cap);
+  if (new == NULL) return -1;
+  ab->b = new;
+  ab->cap = cap;
+  return 0;
+}
+
+void abAppend(struct abuf *ab, const char *s, int len) {
+  if (abReserve(ab, len) == -1) return;
+  memcpy(&ab->b[ab->len], s, len);
+  ab->len += len;
+}
+
+// escape sequence parameters, which are never negative
+void abAppendInt(struct abuf *ab, unsigned n) {
+  char digits[12];
+  int i = sizeof(digits);
+  do {
+    digits[--i] = '0' + n % 10;
+    n /= 10;
+  } while (n > 0 && i > 0);
+  abAppend(ab, &digits[i], sizeof(digits) - i);
+}
+
+void abReset(struct abuf *ab) {
+  ab->len = 0;
+}
+
+void abFree(struct abuf *ab) {
+  free(ab->b);
+  ab->b = NULL;
+  ab->len = ab->cap = 0;
+}
+
+/*** screen ***/
+
+void screenResize(struct screenBuffer *s, int rows, int cols) {
+  s->rows = rows;
+  s->cols = cols;
+  s->chars = realloc(s->chars, rows * cols);
+  s->attrs = realloc(s->attrs, rows * cols);
+  if (rows * cols > 0 && (!s->chars || !s->attrs)) die("realloc");
+}
+
+void screenClear(struct screenBuffer *s) {
+  memset(s->chars, ' ', s->rows * s->cols);
+  memset(s->attrs, HL_NORMAL, s->rows * s->cols);
+}
+
+void screenPutText(struct screenBuffer *s, int y, int x, const char *text, int len,
+                   unsigned char attr) {
+  if (y < 0 || y >= s->rows || x >= s->cols) return;
+  if (len > s->cols - x) len = s->cols - x;
+  memcpy(&s->chars[y * s->cols + x], text, len);
+  memset(&s->attrs[y * s->cols + x], attr, len);
+}
+
+// the color escape for each highlight class, built once at startup
+struct sgrSeq {
+  int color;
+  int len;
+  char seq[8];
+};
+
+struct sgrSeq hlSGR[HL_CLASSES];
+
+void editorInitSGR() {
+  for (int hl = 0; hl < HL_CLASSES; hl++) {
+    hlSGR[hl].color = (hl == HL_NORMAL) ? 39 : editorSyntaxToColor(hl);
+    hlSGR[hl].len = snprintf(hlSGR[hl].seq, sizeof(hlSGR[hl].seq), "\x1b[%dm",
+                             hlSGR[hl].color);
+  }
+}
+
+// switch the terminal from one cell attribute to another
+void abAppendAttr(struct abuf *ab, unsigned char from, unsigned char to) {
+  if ((from ^ to) & ATTR_REVERSE) {
+    if (to & ATTR_REVERSE) abAppend(ab, "\x1b[7m", 4);
+    else abAppend(ab, "\x1b[27m", 5);
+  }
+  struct sgrSeq *sgr = &hlSGR[to & ~ATTR_REVERSE];
+  if (sgr->color != hlSGR[from & ~ATTR_REVERSE].color)
+    abAppend(ab, sgr->seq, sgr->len);
+}
+
+void abAppendCursor(struct abuf *ab, int y, int x) {
+  abAppend(ab, "\x1b[", 2);
+  abAppendInt(ab, y + 1);
+  abAppend(ab, ";", 1);
+  abAppendInt(ab, x + 1);
+  abAppend(ab, "H", 1);
+}
+
+// a gap of this many unchanged cells is cheaper to jump over than repaint
+#define SCREEN_SKIP_GAP 8
+
+int screenRowsEqual(struct screenBuffer *a, int ya, struct screenBuffer *b, int yb) {
+  int cols = a->cols;
+  return !memcmp(&a->chars[ya * cols], &b->chars[yb * cols], cols) &&
+         !memcmp(&a->attrs[ya * cols], &b->attrs[yb * cols], cols);
+}
+
+// whether more of the frame's top rows match the screen moved by n rows
+// than as it is
+int screenScrollPays(struct screenBuffer *f, struct screenBuffer *s, int rows, int n) {
+  int moved = 0, still = 0;
+  for (int y = 0; y < rows; y++) {
+    if (y + n >= 0 && y + n < rows && screenRowsEqual(f, y, s, y + n)) moved++;
+    if (screenRowsEqual(f, y, s, y)) still++;
+  }
+  return moved > still;
+}
+
+// do to the top rows of the screen what scrolling n rows up (down when
+// negative) does on the terminal, leaving blank rows behind
+void screenScroll(struct screenBuffer *s, int rows, int n) {
+  int cols = s->cols, keep = rows - abs(n);
+  int from = n > 0 ? n : 0, to = n > 0 ? 0 : -n, blank = n > 0 ? keep : 0;
+  memmove(&s->chars[to * cols], &s->chars[from * cols], keep * cols);
+  memmove(&s->attrs[to * cols], &s->attrs[from * cols], keep * cols);
+  memset(&s->chars[blank * cols], ' ', abs(n) * cols);
+  memset(&s->attrs[blank * cols], HL_NORMAL, abs(n) * cols);
+}
+
+// emit only what differs between the composed frame and the screen the
+// terminal already shows, then make the frame the new screen
+void editorFlushFrame(struct abuf *ab) {
+  struct screenBuffer *f = &conf.frame, *s = &conf.screen;
+  int cols = f->cols;
+  if (!conf.screen_valid || s->rows != f->rows || s->cols != cols) {
+    screenResize(s, f->rows, cols);
+    screenClear(s);
+    abAppend(ab, "\x1b[2J", 4);
+    conf.screen_valid = 1;
+    conf.screen_rowoff = conf.rowoff;
+  }
+
+  // when the view has moved a few rows, the terminal shifts what it shows
+  // inside a scroll region over the text rows (DECSTBM, then SU or SD),
+  // so only the rows uncovered are sent below
+  int shift = conf.rowoff - conf.screen_rowoff;
+  if (shift && abs(shift) < conf.screenrows &&
+      screenScrollPays(f, s, conf.screenrows, shift)) {
+    abAppend(ab, "\x1b[1;", 4);
+    abAppendInt(ab, conf.screenrows);
+    abAppend(ab, "r\x1b[", 3);
+    abAppendInt(ab, abs(shift));
+    abAppend(ab, shift > 0 ? "S" : "T", 1);
+    abAppend(ab, "\x1b[r", 3);
+    screenScroll(s, conf.screenrows, shift);
+  }
+  conf.screen_rowoff = conf.rowoff;
+
+  unsigned char term_attr = HL_NORMAL;
+  int cur_y = -1, cur_x = -1;
+
+  for (int y = 0; y < f->rows; y++) {
+    char *fc = &f->chars[y * cols], *sc = &s->chars[y * cols];
+    unsigned char *fa = &f->attrs[y * cols], *sa = &s->attrs[y * cols];
+    if (!memcmp(fc, sc, cols) && !memcmp(fa, sa, cols)) continue;
+
+    // blank cells at the end of the row are cleared in one go
+    int tail = cols;
+    while (tail > 0 && fc[tail - 1] == ' ' && fa[tail - 1] == HL_NORMAL) tail--;
+    int x = 0;
+    while (x < tail) {
+      if (fc[x] == sc[x] && fa[x] == sa[x]) {
+        x++;
+        continue;
+      }
+      int end = x + 1, same = 0;
+      for (int k = x + 1; k < tail && same < SCREEN_SKIP_GAP; k++) {
+        if (fc[k] == sc[k] && fa[k] == sa[k]) {
+          same++;
+        } else {
+          same = 0;
+          end = k + 1;
+        }
+      }
+      if (cur_y != y || cur_x != x) abAppendCursor(ab, y, x);
+      // one copy per run of cells sharing an attribute
+      while (x < end) {
+        int run = x + 1;
+        while (run < end && fa[run] == fa[x]) run++;
+        if (fa[x] != term_attr) {
+          abAppendAttr(ab, term_attr, fa[x]);
+          term_attr = fa[x];
+        }
+        abAppend(ab, &fc[x], run - x);
+        x = run;
+      }
+      cur_y = y;
+      cur_x = (end < cols) ? end : -1;
+    }
+    int dirty_tail = 0;
+    for (int k = tail; k < cols; k++) {
+      if (sc[k] != ' ' || sa[k] != HL_NORMAL) {
+        dirty_tail = 1;
+        break;
+      }
+    }
+    if (dirty_tail) {
+      if (cur_y != y || cur_x != tail) abAppendCursor(ab, y, tail);
+      if (term_attr != HL_NORMAL) {
+        abAppendAttr(ab, term_attr, HL_NORMAL);
+        term_attr = HL_NORMAL;
+      }
+      abAppend(ab, "\x1b[K", 3);
+      cur_y = y;
+      cur_x = tail;
+    }
   }
-  buf[i] = '\0';
-  if (buf[0] != '\x1b' || buf[1] != '[') return -1;
-  if (sscanf(&buf[2], "%d;%d", n_row, n_col) != 2) return -1;
-  return 0;
+  if (term_attr != HL_NORMAL) abAppendAttr(ab, term_attr, HL_NORMAL);
+
+  struct screenBuffer shown = conf.screen;
+  conf.screen = conf.frame;
+  conf.frame = shown;
 }
 
-// window resize
-int getWindowSize(int *n_row, int *n_col) {
-  struct winsize ws;
+// spend time with no keys pending highlighting ahead of the viewport
+void editorIdle() {
+  struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+  while (editorHighlightPending() || editorIndexPending()) {
+    if (editorHighlightPending())
+      editorHighlightUpto(conf.nrows - 1, HL_IDLE_SLICE);
+    else
+      editorIndexBuild(INDEX_IDLE_SLICE);
+    if (poll(&pfd, 1, 0) > 0) break;
+  }
+}
 
-  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
-    if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12) return -1;
-    return getCursorPosition(n_row, n_col);
-    // editorReadKey();
-    // return -1;
-  } else {
-    *n_col = ws.ws_col;
-    *n_row = ws.ws_row;
-    return 0;
+/*** input ***/
+
+// keys are read through a buffer a read(2) at a time instead of a byte at
+// a time. With bracketed paste on, the terminal wraps pasted text in
+// ESC [200~ ... ESC [201~, which comes back as one PASTE key so the text
+// goes in as a single edit
+#define PASTE_CHUNK (64 << 10)
+#define PASTE_IDLE_READS 10             // give up on a paste after ~1s of quiet
+
+struct editorInput {
+  char buf[4096];
+  int pos, len;
+  char *paste;
+  size_t paste_len, paste_cap;
+  char *spill;                    // keys after a paste that buf can't hold
+  size_t spill_pos, spill_len;
+} input;
+
+// whether input arrives within ms, or at all for -1
+int inputWait(int ms) {
+  struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+  int n = poll(&pfd, 1, ms);
+  if (n == -1 && errno != EINTR) die("poll");
+  return n > 0;
+}
+
+// refill the buffer, or return 0 when nothing came within ms
+int inputFill(char *buf, size_t size, int ms) {
+  if (input.spill_pos < input.spill_len) {
+    size_t n = input.spill_len - input.spill_pos;
+    if (n > size) n = size;
+    memcpy(buf, input.spill + input.spill_pos, n);
+    input.spill_pos += n;
+    return n;
+  }
+  if (editorReplaying()) return editorReplayFill(buf);
+  if (!inputWait(ms)) return 0;
+  int n = read(STDIN_FILENO, buf, size);
+  if (n == -1 && errno != EAGAIN && errno != EINTR) die("read");
+  if (n == 0) {
+    // readable yet empty: the terminal has gone away
+    errno = EIO;
+    die("read");
   }
+  if (n > 0 && conf.replay.record) fwrite(buf, 1, n, conf.replay.record);
+  return n > 0 ? n : 0;
 }
 
+// one byte of input, waiting up to ms for it
+int inputByte(char *c, int ms) {
+  if (input.pos == input.len) {
+    int n = inputFill(input.buf, sizeof(input.buf), ms);
+    if (n == 0) return 0;
+    input.pos = 0;
+    input.len = n;
+  }
+  *c = input.buf[input.pos++];
+  return 1;
+}
 
-int is_separator(int c) {
-  return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+int editorInputPending() {
+  return input.pos < input.len || input.spill_pos < input.spill_len;
 }
 
+// put n bytes ahead of whatever is still waiting in input.spill
+void inputSpill(const char *p, size_t n) {
+  size_t left = input.spill_len - input.spill_pos;
+  char *spill = malloc(n + left);
+  if (!spill) die("malloc");
+  memcpy(spill, p, n);
+  if (left) memcpy(spill + n, input.spill + input.spill_pos, left);
+  free(input.spill);
+  input.spill = spill;
+  input.spill_pos = 0;
+  input.spill_len = n + left;
+}
 
-void editorSelectSyntaxHighlight() {
-  conf.syntax = NULL;
-  if (conf.filename == NULL) return;
-  char *ext = strrchr(conf.filename, '.');
-  for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
-    struct editorSyntax *s = &HLDB[j];
-    unsigned int i = 0;
-    while (s->filematch[i]) {
-      int is_ext = (s->filematch[i][0] == '.');
-      if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
-          (!is_ext && strstr(conf.filename, s->filematch[i]))) {
-        conf.syntax = s;
-        for (int filerow = 0; filerow < conf.nrows; filerow++) {
-          editorUpdateSyntax(&conf.row[filerow]);
-        }
-        return;
+// gather a paste up to its end marker, reading straight into input.paste
+void inputReadPaste() {
+  static const char end[] = "\x1b[201~";
+  input.paste_len = 0;
+  size_t scanned = 0;
+  int idle = 0;
+  while (idle < PASTE_IDLE_READS) {
+    if (input.paste_cap - input.paste_len < PASTE_CHUNK) {
+      input.paste_cap = input.paste_cap ? input.paste_cap * 2 : PASTE_CHUNK * 2;
+      input.paste = realloc(input.paste, input.paste_cap);
+      if (!input.paste) die("realloc");
+    }
+    int n;
+    if (input.pos < input.len) {
+      n = input.len - input.pos;
+      memcpy(input.paste + input.paste_len, input.buf + input.pos, n);
+      input.pos = input.len;
+    } else {
+      n = inputFill(input.paste + input.paste_len,
+                    input.paste_cap - input.paste_len, INPUT_SEQ_TIMEOUT);
+      if (n == 0) {
+        idle++;
+        continue;
       }
-      i++;
+      idle = 0;
+    }
+    input.paste_len += n;
+    char *hit = memmem(input.paste + scanned, input.paste_len - scanned, end, sizeof(end) - 1);
+    if (hit) {
+      // keys typed after the paste go back to the input buffer, and what
+      // it can't hold is read from input.spill next
+      char *rest = hit + sizeof(end) - 1;
+      size_t after = input.paste + input.paste_len - rest;
+      size_t fit = after < sizeof(input.buf) ? after : sizeof(input.buf);
+      memcpy(input.buf, rest, fit);
+      if (after > fit) inputSpill(rest + fit, after - fit);
+      input.pos = 0;
+      input.len = fit;
+      input.paste_len = hit - input.paste;
+      return;
     }
+    scanned = input.paste_len > sizeof(end) ? input.paste_len - (sizeof(end) - 1) : 0;
   }
 }
 
-void editorUpdateSyntax(struct editorRow* row) {
-  row->hl = realloc(row->hl, row->rsize);
-  memset(row->hl, HL_NORMAL, row->rsize);
-  if (!conf.syntax) return;
-  char **keywords = conf.syntax->keywords;
-  char *scs = conf.syntax->singleline_comment_start;
-  int scs_len = scs ? strlen(scs) : 0;
-  char *mcs = conf.syntax->multiline_comment_start;
-  char *mce = conf.syntax->multiline_comment_end;
-  int mcs_len = mcs ? strlen(mcs) : 0;
-  int mce_len = mce ? strlen(mce) : 0;
-  int prev_sep = 1;
-  int in_string = 0;
-  int in_comment = (row->index > 0 && conf.row[row->index - 1].hl_open_comment);
-  int i = 0;
-  while (i < row->rsize) {
-    char c = row->render[i];
-    unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+/*** events ***/
 
-    if (scs_len && !in_string && !in_comment) {
-      if (!strncmp(&row->render[i], scs, scs_len)) {
-        memset(&row->hl[i], HL_COMMENT, row->rsize - i);
-        break;
-      }
-    }
+// between keys the editor sleeps in poll(2) until a key comes, the window
+// is resized, a background task finishes or a timer is due, so an idle
+// editor costs no CPU. Signal handlers and threads wake it by writing a
+// byte naming the event to a pipe
+#define JOURNAL_COMMIT_MS 100           // quiet after an edit before syncing
+#define STATUS_MSG_SECS 5
+#define TASK_IDLE_MS 50                 // quiet before work ahead is queued
 
-    if (mcs_len && mce_len && !in_string) {
-      if (in_comment) {
-        row->hl[i] = HL_MLCOMMENT;
-        if (!strncmp(&row->render[i], mce, mce_len)) {
-          memset(&row->hl[i], HL_MLCOMMENT, mce_len);
-          i += mce_len;
-          in_comment = 0;
-          prev_sep = 1;
-          continue;
-        } else {
-          i++;
-          continue;
-        }
-      } else if (!strncmp(&row->render[i], mcs, mcs_len)) {
-        memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
-        i += mcs_len;
-        in_comment = 1;
-        continue;
-      }
-    }
+int eventPipe[2] = { -1, -1 };
 
-    if (conf.syntax->flags & HL_HIGHLIGHT_STRINGS) {
-      if (in_string) {
-        row->hl[i] = HL_STRING;
-        if (c == '\\' && i + 1 < row->rsize) {
-          row->hl[i + 1] = HL_STRING;
-          i += 2;
-          continue;
-        }
-        if (c == in_string) in_string = 0;
-        i++;
-        prev_sep = 1;
-        continue;
-      } else {
-        if (c == '"' || c == '\'') {
-          in_string = c;
-          row->hl[i] = HL_STRING;
-          i++;
-          continue;
-        }
-      }
-    }
+// safe from signal handlers and other threads
+void editorWake(char event) {
+  int saved = errno;
+  if (eventPipe[1] != -1) write(eventPipe[1], &event, 1);
+  errno = saved;
+}
 
-    if (conf.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-      if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
-          (c == '.' && prev_hl == HL_NUMBER)) {
-        row->hl[i] = HL_NUMBER;
-        i++;
-        prev_sep = 0;
-        continue;
-      }
-    }
+void editorHandleWinch(int sig) {
+  (void) sig;
+  editorWake(EVENT_RESIZE);
+}
 
-    if (prev_sep) {
-      int j;
-      for ( j = 0; keywords[j]; j++) {
-        int klen = strlen(keywords[j]);
-        int kw2 = keywords[j][klen - 1] == '|';
-        if (kw2) klen--;
-        if (!strncmp(&row->render[i], keywords[j], klen) &&
-            is_separator(row->render[i + klen])) {
-          memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-          i += klen;
-          break;
-        }
-      }
-      if (keywords[j]) {
-        prev_sep = 0;
-        continue;
-      }
-    }
+void editorHandleStats(int sig) {
+  (void) sig;
+  editorWake(EVENT_STATS);
+}
 
-    prev_sep = is_separator(c);
-    i++;
+void statHistDump(FILE *fp, const char *name, struct statHist *h) {
+  fprintf(fp, "%s n %lu mean %.1f p50 %llu p90 %llu p99 %llu max %llu\n",
+          name, h->n, statMean(h), statQuantile(h, 0.5), statQuantile(h, 0.9),
+          statQuantile(h, 0.99), h->max);
+  int last = STAT_BUCKETS - 1;
+  while (last > 0 && !h->bucket[last]) last--;
+  fprintf(fp, "%s buckets", name);
+  for (int b = 0; b <= last; b++) fprintf(fp, " %lu", h->bucket[b]);
+  fprintf(fp, "\n");
+}
+
+// write what has been collected; the first dump only starts collecting
+void editorStatsDump() {
+  char path[PATH_MAX];
+  char *env = getenv("ZUMA_STATS_FILE");
+  int fd;
+  if (env) {
+    snprintf(path, sizeof(path), "%s", env);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, 0600);
+  } else {
+    // a fresh file each time, as a fixed name in a shared directory could
+    // be a symlink planted by someone else
+    char *tmp = getenv("TMPDIR");
+    snprintf(path, sizeof(path), "%s/zuma-stats.%d.XXXXXX",
+             tmp && *tmp ? tmp : "/tmp", (int) getpid());
+    fd = mkstemp(path);
+  }
+  FILE *fp = (fd != -1) ? fdopen(fd, "w") : NULL;
+  if (!fp) {
+    editorSetStatusMessage("Can't write %s: %s", path, strerror(errno));
+    if (fd != -1) close(fd);
+    return;
+  }
+  if (!stats.enabled) {
+    statsEnable();
+    fprintf(fp, "stats were off, collecting from now on\n");
+  }
+  fprintf(fp, "pid %d seconds %ld rows %d version %u\n", (int) getpid(),
+          (long) (time(NULL) - stats.since), conf.nrows, conf.version);
+  statHistDump(fp, "key_to_paint_ns", &stats.key);
+  statHistDump(fp, "update_syntax_ns", &stats.syntax);
+  statHistDump(fp, "rows_rehighlighted_per_edit", &stats.rows);
+  statHistDump(fp, "frame_bytes", &stats.frame);
+  statHistDump(fp, "row_allocs_per_key", &stats.allocs);
+  struct rowHeap *h = &conf.heap;
+  fprintf(fp, "row_storage allocs %lu reused %lu large %lu frees %lu live %zu slabs %zu text %zu\n",
+          h->allocs, h->reused, h->large, h->frees, h->live_bytes, h->slab_bytes,
+          h->text_bytes);
+  fprintf(fp, "tasks workers %d\n", pool.nworkers);
+  if (fclose(fp) != 0) {
+    editorSetStatusMessage("Can't write %s: %s", path, strerror(errno));
+    return;
   }
-  int changed = (row->hl_open_comment != in_comment);
-  row->hl_open_comment = in_comment;
-  if (changed && row->index + 1 < conf.nrows)
-    editorUpdateSyntax(&conf.row[row->index + 1]);
+  editorSetStatusMessage("Stats written to %s", path);
 }
 
-int editorSyntaxToColor(int hl) {
-  switch (hl) {
-    case HL_COMMENT: case HL_MLCOMMENT: return 36;
-    case HL_KEYWORD1: return 33;
-    case HL_KEYWORD2: return 32;
-    case HL_STRING: return 35;
-    case HL_NUMBER: return 31;
-    case HL_MATCH: return 34;
-    default: return 37;
+void editorInitEvents() {
+  if (pipe(eventPipe) == -1) die("pipe");
+  for (int j = 0; j < 2; j++) {
+    fcntl(eventPipe[j], F_SETFL, fcntl(eventPipe[j], F_GETFL) | O_NONBLOCK);
+    fcntl(eventPipe[j], F_SETFD, FD_CLOEXEC);
   }
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = editorHandleWinch;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+  if (sigaction(SIGWINCH, &sa, NULL) == -1) die("sigaction");
+  sa.sa_handler = editorHandleStats;
+  if (sigaction(SIGUSR1, &sa, NULL) == -1) die("sigaction");
+  if (getenv("ZUMA_STATS")) statsEnable();
+  char *env = getenv("ZUMA_AUTOSAVE");
+  conf.autosave = env ? atoi(env) : 0;
 }
 
-// void editorSelectSyntaxHighlight() {
-//   conf.syntax = NULL;
-//   if (conf.filename == NULL) return;
-//   char *ext = strrchr(conf.filename, '.');
-//   for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
-//     struct editorSyntax *s = &HLDB[j];
-//     unsigned int i = 0;
-//     while (s->filematch[i]) {
-//       int is_ext = (s->filematch[i][0] == '.');
-//       if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
-//           (!is_ext && strstr(conf.filename, s->filematch[i]))) {
-//         conf.syntax = s;
-//
-//         int filerow;
-//         for (filerow = 0; filerow < conf.nrows; filerow++) {
-//           editorUpdateSyntax(&conf.row[filerow]);
-//         }
-//         return;
-//       }
-//       i++;
-//     }
-//   }
-// }
+void editorResize() {
+  int rows, cols;
+  if (getWindowSize(&rows, &cols) == -1) return;
+  screenResize(&conf.frame, rows, cols);
+  conf.screenrows = rows - 2;
+  conf.screencols = cols;
+  conf.screen_valid = 0;
+}
 
-// append buffer
-struct abuf {
-  char *b;
-  int len;
-};
+// work ahead of need waits for a pause in typing, so a run of edits
+// doesn't keep snapshotting the buffer only to throw the result away
+int editorTasksWanted() {
+  return pool.nworkers &&
+         ((editorHighlightPending() && !conf.hl_job) ||
+          (editorIndexPending() && !conf.index.job));
+}
 
-#define ABUF_INIT {NULL, 0}
+void editorTasksStart() {
+  if (editorHighlightPending() && !conf.hl_job) editorHighlightSubmit();
+  if (editorIndexPending() && !conf.index.job) editorIndexSubmit();
+}
 
-void abAppend(struct abuf *ab, const char *s, int len) {
-  char *new = realloc(ab->b, ab->len + len);
-  if (new == NULL) return;
-  memcpy(&new[ab->len], s, len);
-  ab->b = new;
-  ab->len += len;
+// what has been edited since the snapshot was taken needn't be finished
+void editorTasksDropStale() {
+  if (conf.hl_job && (conf.hl_job->snap->version != conf.version ||
+                      conf.hl_job->gen != conf.hl_gen))
+    editorHighlightCancel();
+  if (conf.index.job && conf.index.job->snap->version != conf.version)
+    editorIndexCancel();
 }
 
-void abFree(struct abuf *ab) {
-  free(ab->b);
+int timerMin(int timeout, int ms) {
+  if (ms < 0) ms = 0;
+  return (timeout == -1 || ms < timeout) ? ms : timeout;
+}
+
+// sleep until something needs doing and do it, returning when a key may
+// be waiting
+void editorWaitEvent() {
+  if (pool.nworkers) {
+    editorTasksDropStale();
+  } else if (editorHighlightPending() || editorIndexPending()) {
+    editorIdle();
+    if (inputWait(0)) return;
+  }
+  time_t now = time(NULL);
+  int timeout = -1;
+  int ahead = editorTasksWanted();
+  if (ahead) timeout = TASK_IDLE_MS;
+  if (conf.journal.len) timeout = timerMin(timeout, JOURNAL_COMMIT_MS);
+  if (conf.statusmsg[0])
+    timeout = timerMin(timeout, (conf.statusmsg_time + STATUS_MSG_SECS - now) * 1000);
+  int autosave = conf.autosave > 0 && conf.dirty && conf.filename && !conf.save.running;
+  if (autosave) timeout = timerMin(timeout, (conf.edit_time + conf.autosave - now) * 1000);
+
+  struct pollfd pfd[2] = {
+    { STDIN_FILENO, POLLIN, 0 },
+    { eventPipe[0], POLLIN, 0 }
+  };
+  int n = poll(pfd, 2, timeout);
+  if (n == -1) {
+    if (errno == EINTR) return;
+    die("poll");
+  }
+  int redraw = 0;
+  if (pfd[1].revents & POLLIN) {
+    char events[64];
+    ssize_t got;
+    while ((got = read(eventPipe[0], events, sizeof(events))) > 0) {
+      for (ssize_t j = 0; j < got; j++) {
+        if (events[j] == EVENT_RESIZE) {
+          editorResize();
+          redraw = 1;
+        } else if (events[j] == EVENT_STATS) {
+          editorStatsDump();
+          redraw = 1;
+        }
+      }
+    }
+    if (conf.save.running) {
+      editorSavePoll(0);
+      redraw |= !conf.save.running;
+    }
+    redraw |= editorTasksReap();
+  }
+  if (n == 0) {
+    editorJournalCommit();
+    if (ahead) editorTasksStart();
+  }
+
+  now = time(NULL);
+  if (conf.statusmsg[0] && now - conf.statusmsg_time >= STATUS_MSG_SECS) {
+    conf.statusmsg[0] = '\0';
+    redraw = 1;
+  }
+  if (autosave && now - conf.edit_time >= conf.autosave) {
+    editorSave();
+    redraw = 1;
+  }
+  if (redraw) editorRefreshScreen();
 }
 
 // prompt for key
 int editorReadKey() {
-  int n_read;
   char c;
-  while ((n_read = read(STDIN_FILENO, &c, 1)) != 1){
-    if (n_read == -1 && errno != EAGAIN) die("editorReadKey");
-  }
+  if (editorReplaying()) editorReplayNext();
+  while (!inputByte(&c, 0)) editorWaitEvent();
+  statsKeyRead();
 
   if (c == '\x1b') {
     char seq[3];
 
-    if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-    if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
+    if (!inputByte(&seq[0], INPUT_SEQ_TIMEOUT)) return '\x1b';
+    if (!inputByte(&seq[1], INPUT_SEQ_TIMEOUT)) return '\x1b';
 
     if (seq[0] == '[') {
       if (seq[1] >= '0' && seq[1] <= '9') {
-        if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
+        int num = seq[1] - '0';
+        do {
+          if (!inputByte(&seq[2], INPUT_SEQ_TIMEOUT)) return '\x1b';
+          if (seq[2] >= '0' && seq[2] <= '9') num = num * 10 + seq[2] - '0';
+        } while (seq[2] >= '0' && seq[2] <= '9' && num < 1000);
         if (seq[2] == '~') {
-          switch (seq[1]) {
-            case '1': return HOME_KEY; // esc [1~
-            case '3': return DEL_KEY;
-            case '4': return END_KEY;
-            case '5': return PAGE_UP;
-            case '6': return PAGE_DOWN;
-            case '7': return HOME_KEY;
-            case '8': return END_KEY;
+          switch (num) {
+            case 1: return HOME_KEY; // esc [1~
+            case 3: return DEL_KEY;
+            case 4: return END_KEY;
+            case 5: return PAGE_UP;
+            case 6: return PAGE_DOWN;
+            case 7: return HOME_KEY;
+            case 8: return END_KEY;
+            case 200:
+              inputReadPaste();
+              return PASTE;
           }
         }
       } else {
@@ -632,12 +4137,12 @@ int editorReadKey() {
 }
 
 void editorMoveCursor(int key) {
-  struct editorRow *row = (conf.cy >= conf.nrows) ? NULL : &conf.row[conf.cy];
+  struct editorRow *row = editorRowAt(conf.cy);
   switch (key) {
     case ARROW_LEFT:
       if (conf.cx != 0) conf.cx--;  else if (conf.cy > 0) {
         conf.cy--;
-        conf.cx = conf.row[conf.cy].size;
+        conf.cx = editorRowAt(conf.cy)->size;
       }
       break;
     case ARROW_RIGHT:
@@ -654,7 +4159,7 @@ void editorMoveCursor(int key) {
       if (conf.cy < conf.nrows) conf.cy++;
       break;
   }
-  row = (conf.cy >= conf.nrows) ? NULL : &conf.row[conf.cy];
+  row = editorRowAt(conf.cy);
   int rowlen = row ? row->size : 0;
   if (conf.cx > rowlen) conf.cx = rowlen;
 }
@@ -664,90 +4169,560 @@ void editorInsertNewline() {
   if (conf.cx == 0) {
     editorInsertRow(conf.cy, "", 0);
   } else {
-    struct editorRow *row = &conf.row[conf.cy];
+    struct editorRow *row = editorRowAt(conf.cy);
     editorInsertRow(conf.cy + 1, &row->chars[conf.cx], row->size - conf.cx);
-    row = &conf.row[conf.cy];
-    row->size = conf.cx;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
+    editorRowTruncate(conf.cy, conf.cx);
   }
   conf.cy++;
   conf.cx = 0;
 }
 
 
-void editorRowInsertChar(struct editorRow *row, int at, int c) {
+void editorRowTruncate(int filerow, int size) {
+  struct editorRow *row = editorRowAt(filerow);
+  editorJournal(J_TRUNCATE, filerow, size, NULL, 0);
+  undoRecord(U_DELETE, filerow, size, &row->chars[size], row->size - size);
+  editorRowOwnChars(row);
+  int gone = row->size - size;
+  row->size = size;
+  row->chars[row->size] = '\0';
+  longRowEdit(row, size, -gone);
+  editorInvalidateRow(filerow);
+}
+
+void editorRowInsertChar(int filerow, int at, int c) {
+  struct editorRow *row = editorRowAt(filerow);
   if (at < 0 || at > row->size) at = row->size;
-  row->chars = realloc(row->chars, row->size + 2);
+  char ch = c;
+  editorJournal(J_INSERT_CHAR, filerow, at, &ch, 1);
+  undoRecord(U_INSERT, filerow, at, &ch, 1);
+  editorRowOwnChars(row);
+  editorRowReserve(row, row->size + 2);
   memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
   row->size++;
   row->chars[at] = c;
-  editorUpdateRow(row);
+  longRowEdit(row, at, 1);
+  editorInvalidateRow(filerow);
+  editorIndexRow(filerow, at, 1);
   conf.dirty++;
 }
 
-void editorRowDelChar(struct editorRow *row, int loc) {
+void editorRowDelChar(int filerow, int loc) {
+  struct editorRow *row = editorRowAt(filerow);
   if (loc < 0 || loc >= row->size) return;
+  editorJournal(J_DELETE_CHAR, filerow, loc, NULL, 0);
+  undoRecord(U_DELETE, filerow, loc, &row->chars[loc], 1);
+  editorRowOwnChars(row);
   memmove(&row->chars[loc], &row->chars[loc + 1], row->size - loc);
   row->size--;
-  editorUpdateRow(row);
+  longRowEdit(row, loc, -1);
+  editorInvalidateRow(filerow);
+  editorIndexRow(filerow, loc, 0);
   conf.dirty++;
 }
 
+size_t editorRowStructSize(struct editorRow *row) {
+  return sizeof(struct editorRow) + ((row->flags & ROW_INLINE) ? ROW_INLINE_MAX : 0);
+}
+
+// row storage a built row holds
+size_t editorRowBytes(struct editorRow *row) {
+  size_t bytes = heapRoundUp(editorRowStructSize(row));
+  if (row->chars != row->inl && !(row->flags & ROW_MAPPED)) bytes += row->cap;
+  if (row->render && !(row->flags & ROW_RENDER_ALIAS)) bytes += heapRoundUp(row->rsize + 1);
+  if (row->hl) bytes += heapRoundUp(row->rsize + 1);
+  if (row->flags & ROW_LONG) bytes += longRowBytes(row);
+  return bytes;
+}
+
 void editorFreeRow(struct editorRow *row) {
-  free(row->render);
-  free(row->chars);
-  free(row->hl);
+  if (row->flags & ROW_LONG) longRowDrop(row);
+  if (!(row->flags & ROW_RENDER_ALIAS)) heapFree(row->render, row->rsize + 1);
+  heapFree(row->hl, row->rsize + 1);
+  if (row->chars != row->inl && !(row->flags & ROW_MAPPED)) {
+    if (editorRowShared(row)) editorShareOrphan(row->chars, row->cap);
+    else heapFree(row->chars, row->cap);
+  }
+  // a snapshot may still be reading text that was kept inline
+  if ((row->flags & ROW_INLINE) && conf.share.readers > 0)
+    editorShareOrphan(row, editorRowStructSize(row));
+  else heapFree(row, editorRowStructSize(row));
 }
 void editorDelRow(int loc) {
   if (loc < 0 || loc >= conf.nrows) return;
-  editorFreeRow(&conf.row[loc]);
-  memmove(&conf.row[loc], &conf.row[loc + 1],
-    sizeof(struct editorRow) * (conf.nrows - loc - 1));
-  for (int j = loc; j < conf.nrows - 1; j++) conf.row[j].index--;
+  editorJournal(J_DELETE_ROW, loc, 0, NULL, 0);
+  if (undoActive()) {
+    struct editorRow *row = editorRowAt(loc);
+    undoRecord(U_DELETE_ROW, loc, 0, row->chars, row->size);
+  }
+  editorFreeRow(ropeRemove(loc));
   conf.nrows--;
+  conf.version++;
+  // the row moving up now follows a different row; its leaf's filter
+  // keeps the removed row's trigrams, which only costs a wasted look
+  editorHighlightFrom(loc);
   conf.dirty++;
 }
 
-void editorRowAppendString(struct editorRow *row, char *s, size_t len) {
-  row->chars = realloc(row->chars, row->size + len + 1);
+void editorRowAppendString(int filerow, char *s, size_t len) {
+  struct editorRow *row = editorRowAt(filerow);
+  editorJournal(J_APPEND, filerow, 0, s, len);
+  undoRecord(U_INSERT, filerow, row->size, s, len);
+  editorRowOwnChars(row);
+  editorRowReserve(row, row->size + len + 1);
   memcpy(&row->chars[row->size], s, len);
   row->size += len;
   row->chars[row->size] = '\0';
-  editorUpdateRow(row);
+  longRowEdit(row, row->size - len, len);
+  editorInvalidateRow(filerow);
+  editorIndexRow(filerow, row->size - len, len);
+  conf.dirty++;
+}
+
+void editorRowInsertString(int filerow, int at, const char *s, int len) {
+  struct editorRow *row = editorRowAt(filerow);
+  if (at < 0 || at > row->size) at = row->size;
+  editorJournal(J_INSERT_TEXT, filerow, at, s, len);
+  undoRecord(U_INSERT, filerow, at, s, len);
+  editorRowOwnChars(row);
+  editorRowReserve(row, row->size + len + 1);
+  memmove(&row->chars[at + len], &row->chars[at], row->size - at + 1);
+  memcpy(&row->chars[at], s, len);
+  row->size += len;
+  longRowEdit(row, at, len);
+  editorInvalidateRow(filerow);
+  editorIndexRow(filerow, at, len);
+  conf.dirty++;
+}
+
+void editorRowDelString(int filerow, int at, int len) {
+  struct editorRow *row = editorRowAt(filerow);
+  if (at < 0 || len <= 0 || at + len > row->size) return;
+  editorJournal(J_DELETE_TEXT, filerow, at, &row->chars[at], len);
+  undoRecord(U_DELETE, filerow, at, &row->chars[at], len);
+  editorRowOwnChars(row);
+  memmove(&row->chars[at], &row->chars[at + len], row->size - at - len + 1);
+  row->size -= len;
+  longRowEdit(row, at, -len);
+  editorInvalidateRow(filerow);
+  editorIndexRow(filerow, at, 0);
   conf.dirty++;
 }
 
 void editorDelChar() {
   if (conf.cy == conf.nrows) return;
   if (conf.cx == 0 && conf.cy == 0) return;
-  struct editorRow *row = &conf.row[conf.cy];
+  struct editorRow *row = editorRowAt(conf.cy);
   if (conf.cx > 0) {
-    editorRowDelChar(row, conf.cx - 1);
+    editorRowDelChar(conf.cy, conf.cx - 1);
     conf.cx--;
   } else {
-    conf.cx = conf.row[conf.cy - 1].size;
-    editorRowAppendString(&conf.row[conf.cy - 1], row->chars, row->size);
+    conf.cx = editorRowAt(conf.cy - 1)->size;
+    editorRowAppendString(conf.cy - 1, row->chars, row->size);
     editorDelRow(conf.cy);
     conf.cy--;
   }
 }
 
+// the end of the line starting at p: a \n, \r\n or lone \r, or end
+const char *editorLineBreak(const char *p, const char *end) {
+  while (p < end && *p != '\n' && *p != '\r') p++;
+  return p;
+}
+
+// put text in at the cursor as one batch: its lines become rows in a
+// single pass, and the rest of the cursor's row follows the last of them;
+// rows are only marked, so it costs one highlight pass and one repaint
+void editorInsertText(const char *text, size_t len) {
+  const char *p = text, *end = text + len;
+  const char *brk = editorLineBreak(p, end);
+  if (conf.cy == conf.nrows) editorInsertRow(conf.nrows, "", 0);
+  if (brk == end) {
+    if (len) editorRowInsertString(conf.cy, conf.cx, text, len);
+    conf.cx += len;
+    return;
+  }
+  struct editorRow *row = editorRowAt(conf.cy);
+  int taillen = row->size - conf.cx;
+  char *tail = malloc(taillen + 1);
+  if (!tail) die("malloc");
+  memcpy(tail, &row->chars[conf.cx], taillen);
+  if (taillen) editorRowTruncate(conf.cy, conf.cx);
+  if (brk > p) editorRowInsertString(conf.cy, conf.cx, p, brk - p);
+
+  int at = conf.cy;
+  while (brk < end) {
+    p = brk + ((brk + 1 < end && brk[0] == '\r' && brk[1] == '\n') ? 2 : 1);
+    brk = editorLineBreak(p, end);
+    editorInsertRow(++at, p, brk - p);
+  }
+  if (taillen) editorRowInsertString(at, brk - p, tail, taillen);
+  free(tail);
+  conf.cy = at;
+  conf.cx = brk - p;
+}
+
 void editorInsertChar(int c) {
   if (conf.cy == conf.nrows) {
     editorInsertRow(conf.nrows,"", 0);
   }
-  editorRowInsertChar(&conf.row[conf.cy], conf.cx, c);
+  editorRowInsertChar(conf.cy, conf.cx, c);
   conf.cx++;
 }
 
 
 
 
+/*** replay ***/
+
+// ZUMA_REPLAY=script runs the editor without a terminal. The script's
+// bytes come in one at a time as if typed, the screen is ZUMA_REPLAY_SIZE
+// (COLSxROWS, 80x24 by default) and frames are kept in memory, written to
+// ZUMA_REPLAY_OUT at the end if it is set. Each key is timed from being
+// read until the editor asks for the next one, which takes in the repaint.
+// ZUMA_REPLAY_INDEX=1 builds the search index whole before the first key,
+// as a session left idle for a moment would have, so edits pay for it.
+// ZUMA_RECORD=file saves the keys typed in a normal session as a script.
+void editorReplayInit() {
+  struct editorReplay *r = &conf.replay;
+  char *env = getenv("ZUMA_RECORD");
+  if (env && !(r->record = fopen(env, "w"))) die("fopen");
+  env = getenv("ZUMA_REPLAY");
+  if (!env) return;
+  FILE *fp = fopen(env, "r");
+  if (!fp) die("fopen");
+  size_t cap = 4096;
+  r->keys = malloc(cap);
+  if (!r->keys) die("malloc");
+  size_t n;
+  while ((n = fread(r->keys + r->len, 1, cap - r->len, fp)) > 0) {
+    r->len += n;
+    if (r->len == cap) {
+      cap *= 2;
+      r->keys = realloc(r->keys, cap);
+      if (!r->keys) die("realloc");
+    }
+  }
+  fclose(fp);
+  r->rows = 24;
+  r->cols = 80;
+  env = getenv("ZUMA_REPLAY_SIZE");
+  if (env && (sscanf(env, "%dx%d", &r->cols, &r->rows) != 2 ||
+              r->cols < 1 || r->rows < 3)) {
+    errno = EINVAL;
+    die("ZUMA_REPLAY_SIZE");
+  }
+}
+
+int editorReplayFill(char *buf) {
+  struct editorReplay *r = &conf.replay;
+  if (r->pos == r->len) return 0;
+  buf[0] = r->keys[r->pos++];
+  return 1;
+}
+
+int replayCompare(const void *a, const void *b) {
+  unsigned long long x = *(const unsigned long long *) a;
+  unsigned long long y = *(const unsigned long long *) b;
+  return x < y ? -1 : x > y;
+}
+
+void editorReplayReport() {
+  struct editorReplay *r = &conf.replay;
+  char *env = getenv("ZUMA_REPLAY_OUT");
+  if (env) {
+    FILE *fp = fopen(env, "w");
+    if (!fp || fwrite(r->out, 1, r->out_len, fp) != r->out_len || fclose(fp) != 0)
+      die("ZUMA_REPLAY_OUT");
+  }
+  if (r->nkeys == 0) {
+    printf("zuma: no keys replayed\n");
+    return;
+  }
+  unsigned long long total = 0;
+  for (int j = 0; j < r->nkeys; j++) total += r->ns[j];
+  qsort(r->ns, r->nkeys, sizeof(r->ns[0]), replayCompare);
+  #define PCT(p) (r->ns[(int) ((r->nkeys - 1) * (p))] / 1e3)
+  printf("zuma: %d keys in %.1f ms, %lu frames on a %dx%d screen\n",
+         r->nkeys, total / 1e6, conf.frames, r->cols, r->rows);
+  printf("zuma: latency us p50 %.1f p90 %.1f p99 %.1f max %.1f\n",
+         PCT(0.5), PCT(0.9), PCT(0.99), PCT(1.0));
+  printf("zuma: %zu bytes written, %.1f bytes/key, %.2f row allocations/key\n",
+         r->out_len, (double) r->out_len / r->nkeys,
+         (double) r->key_allocs / r->nkeys);
+  #undef PCT
+}
+
+// between two keys: time the last one, and let what finished on the task
+// pool land as it would have while the editor waited for the next
+void editorReplayNext() {
+  struct editorReplay *r = &conf.replay;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (r->timing) {
+    if (r->nkeys == r->cap) {
+      r->cap = r->cap ? r->cap * 2 : 1024;
+      r->ns = realloc(r->ns, sizeof(r->ns[0]) * r->cap);
+      if (!r->ns) die("realloc");
+    }
+    r->ns[r->nkeys++] = (now.tv_sec - r->start.tv_sec) * 1000000000ULL +
+                        now.tv_nsec - r->start.tv_nsec;
+    r->key_allocs += conf.heap.allocs - r->allocs;
+    r->timing = 0;
+  }
+  // the script ran out before quitting
+  if (r->pos == r->len && !editorInputPending()) {
+    editorSavePoll(1);
+    editorReplayReport();
+    exit(0);
+  }
+  if (r->pos == 0 && getenv("ZUMA_REPLAY_INDEX") && atoi(getenv("ZUMA_REPLAY_INDEX")))
+    while (editorIndexPending()) editorIndexBuild(INDEX_IDLE_SLICE);
+  char events[64];
+  while (read(eventPipe[0], events, sizeof(events)) > 0);
+  if (conf.save.running) editorSavePoll(0);
+  editorTasksReap();
+  if (pool.nworkers) editorTasksDropStale();
+  r->timing = 1;
+  r->allocs = conf.heap.allocs;
+  clock_gettime(CLOCK_MONOTONIC, &r->start);
+}
+
+/*** undo ***/
+
+// the mutators above log what each edit put in or took out, which is all
+// it takes to run it backwards or forwards again. A key press makes one
+// group of records, undone together; a run of typing or of deleting in
+// one place grows a single record rather than adding one per key. The
+// records live in an arena of blocks, and the oldest blocks are let go
+// once it passes ZUMA_UNDO_MB, 64 by default.
+#define UNDO_BLOCK (64 << 10)
+#define UNDO_CAP_MB 64
+
+struct undoRec {
+  int type;
+  int group;
+  int row, at;
+  int len;
+  int cx, cy;                     // cursor before the group
+  int after_cx, after_cy;         // and after it
+  char data[];
+};
+
+struct undoBlock {
+  struct undoBlock *next;
+  size_t used, size;
+  char mem[];
+};
+
+struct editorUndo {
+  int enabled;
+  int applying;                   // an undo or redo is running the mutators
+  struct undoBlock *first, *last;
+  size_t bytes, cap;
+  struct undoRec **recs;
+  int base, top, n, size;         // [base, top) undoable, [top, n) redoable
+  int group;                      // the key press being recorded
+  int group_used;                 // it has records already
+} undo;
+
+int undoActive() {
+  return undo.enabled && !undo.applying;
+}
+
+void undoInit() {
+  char *env = getenv("ZUMA_UNDO_MB");
+  undo.cap = (size_t) ((env && atoi(env) > 0) ? atoi(env) : UNDO_CAP_MB) << 20;
+  undo.enabled = 1;
+}
+
+size_t undoRecSize(int len) {
+  return (sizeof(struct undoRec) + len + 7) & ~(size_t) 7;
+}
+
+int undoInBlock(struct undoRec *rec, struct undoBlock *b) {
+  return (char *) rec >= b->mem && (char *) rec < b->mem + b->size;
+}
+
+// let go of the oldest blocks, and the records in them, while over the
+// cap; the newest record is always kept
+void undoTrim() {
+  while (undo.bytes > undo.cap && undo.first != undo.last) {
+    struct undoBlock *b = undo.first;
+    int keep = undo.base;
+    while (keep < undo.n && undoInBlock(undo.recs[keep], b)) keep++;
+    if (keep == undo.n) break;
+    undo.base = keep;
+    if (undo.top < undo.base) undo.top = undo.base;
+    undo.first = b->next;
+    undo.bytes -= b->size;
+    free(b);
+  }
+  if (undo.base > undo.size / 2) {
+    memmove(undo.recs, &undo.recs[undo.base], sizeof(struct undoRec *) * (undo.n - undo.base));
+    undo.top -= undo.base;
+    undo.n -= undo.base;
+    undo.base = 0;
+  }
+}
+
+struct undoRec *undoAlloc(int len) {
+  size_t need = undoRecSize(len);
+  struct undoBlock *b = undo.last;
+  if (!b || b->size - b->used < need) {
+    size_t size = need > UNDO_BLOCK ? need : UNDO_BLOCK;
+    b = malloc(sizeof(struct undoBlock) + size);
+    if (!b) die("malloc");
+    b->next = NULL;
+    b->used = 0;
+    b->size = size;
+    if (undo.last) undo.last->next = b;
+    else undo.first = b;
+    undo.last = b;
+    undo.bytes += size;
+  }
+  struct undoRec *rec = (struct undoRec *) (b->mem + b->used);
+  b->used += need;
+  return rec;
+}
+
+// make room for extra more bytes of data in the newest record, in place
+// when it is the last thing in its block
+struct undoRec *undoGrow(struct undoRec *rec, int extra) {
+  struct undoBlock *b = undo.last;
+  char *end = (char *) rec + undoRecSize(rec->len);
+  size_t more = undoRecSize(rec->len + extra) - undoRecSize(rec->len);
+  if (end == b->mem + b->used && b->size - b->used >= more) {
+    b->used += more;
+    return rec;
+  }
+  struct undoRec *copy = undoAlloc(rec->len + extra);
+  memcpy(copy, rec, sizeof(struct undoRec) + rec->len);
+  undo.recs[undo.n - 1] = copy;
+  return copy;
+}
+
+// a single character typed or deleted next to the last one of the same
+// kind, in an earlier key press, joins its record
+int undoCoalesce(int type, int row, int at, const char *data, int len) {
+  if (len != 1 || undo.group_used || undo.top == undo.base || undo.top != undo.n) return 0;
+  struct undoRec *rec = undo.recs[undo.n - 1];
+  if (rec->type != type || rec->row != row || rec->group != undo.group - 1) return 0;
+  if (type == U_INSERT && at == rec->at + rec->len) {
+    rec = undoGrow(rec, 1);
+    rec->data[rec->len++] = data[0];
+  } else if (type == U_DELETE && at == rec->at) {
+    rec = undoGrow(rec, 1);
+    rec->data[rec->len++] = data[0];
+  } else if (type == U_DELETE && at + 1 == rec->at) {
+    rec = undoGrow(rec, 1);
+    memmove(rec->data + 1, rec->data, rec->len++);
+    rec->data[0] = data[0];
+    rec->at = at;
+  } else {
+    return 0;
+  }
+  // the key press carries on the group it joined
+  undo.group = rec->group;
+  undo.group_used = 1;
+  return 1;
+}
+
+void undoRecord(int type, int row, int at, const char *data, int len) {
+  if (!undoActive()) return;
+  undo.n = undo.top;                      // a new edit ends what could be redone
+  if (undoCoalesce(type, row, at, data, len)) return;
+  struct undoRec *rec = undoAlloc(len);
+  rec->type = type;
+  rec->group = undo.group;
+  rec->row = row;
+  rec->at = at;
+  rec->len = len;
+  rec->cx = rec->after_cx = conf.cx;
+  rec->cy = rec->after_cy = conf.cy;
+  if (len) memcpy(rec->data, data, len);
+  if (undo.n == undo.size) {
+    undo.size = undo.size ? undo.size * 2 : 256;
+    undo.recs = realloc(undo.recs, sizeof(struct undoRec *) * undo.size);
+    if (!undo.recs) die("realloc");
+  }
+  undo.recs[undo.n++] = rec;
+  undo.top = undo.n;
+  undo.group_used = 1;
+  undoTrim();
+}
+
+// bracket the edits made for one key press
+void undoBegin() {
+  undo.group_used = 0;
+}
+
+void undoEnd() {
+  if (!undo.group_used) return;
+  struct undoRec *rec = undo.recs[undo.top - 1];
+  rec->after_cx = conf.cx;
+  rec->after_cy = conf.cy;
+  undo.group++;
+}
+
+void undoApply(struct undoRec *rec, int forward) {
+  int insert = (rec->type == U_INSERT || rec->type == U_INSERT_ROW) == forward;
+  switch (rec->type) {
+    case U_INSERT:
+    case U_DELETE:
+      if (insert) editorRowInsertString(rec->row, rec->at, rec->data, rec->len);
+      else editorRowDelString(rec->row, rec->at, rec->len);
+      break;
+    case U_INSERT_ROW:
+    case U_DELETE_ROW:
+      if (insert) editorInsertRow(rec->row, rec->data, rec->len);
+      else editorDelRow(rec->row);
+      break;
+  }
+}
+
+void editorUndo() {
+  if (undo.top == undo.base) {
+    editorSetStatusMessage("Nothing to undo");
+    return;
+  }
+  undo.applying = 1;
+  int group = undo.recs[undo.top - 1]->group;
+  struct undoRec *rec = NULL;
+  while (undo.top > undo.base && undo.recs[undo.top - 1]->group == group) {
+    rec = undo.recs[--undo.top];
+    undoApply(rec, 0);
+  }
+  undo.applying = 0;
+  conf.cx = rec->cx;
+  conf.cy = rec->cy;
+  undo.group++;
+}
+
+void editorRedo() {
+  if (undo.top == undo.n) {
+    editorSetStatusMessage("Nothing to redo");
+    return;
+  }
+  undo.applying = 1;
+  int group = undo.recs[undo.top]->group;
+  struct undoRec *rec = NULL;
+  while (undo.top < undo.n && undo.recs[undo.top]->group == group) {
+    rec = undo.recs[undo.top++];
+    undoApply(rec, 1);
+  }
+  undo.applying = 0;
+  conf.cx = rec->after_cx;
+  conf.cy = rec->after_cy;
+  undo.group++;
+}
+
 // prompt for signal processing
 int editorProcessKeyPress(){
   static int dirty_q = 0;
   int c = editorReadKey();
+  int dirty = conf.dirty;
+  undoBegin();
   switch (c) {
     case '\r':
       editorInsertNewline();
@@ -772,19 +4747,35 @@ int editorProcessKeyPress(){
       }
 
     case CTRL_KEY('f'):
-      editorFind();
+      editorFind(0);
+      break;
+
+    case CTRL_KEY('r'):
+      editorFind(1);
       break;
 
     case CTRL_KEY('s'):
       editorSave();
       break;
 
+    case PASTE:
+      editorInsertText(input.paste, input.paste_len);
+      break;
+
+    case CTRL_KEY('z'):
+      editorUndo();
+      break;
+
+    case CTRL_KEY('y'):
+      editorRedo();
+      break;
+
     case HOME_KEY:
       conf.cx = 0;
       break;
 
     case END_KEY:
-      if (conf.cy < conf.nrows) conf.cx = conf.row[conf.cy].size;
+      if (conf.cy < conf.nrows) conf.cx = editorRowAt(conf.cy)->size;
       break;
 
     case BACKSPACE:
@@ -794,6 +4785,12 @@ int editorProcessKeyPress(){
       editorDelChar();
       break;
 
+    // latency and allocation figures in place of the file name, see stats
+    case CTRL_KEY('t'):
+      stats.overlay = !stats.overlay;
+      if (stats.overlay) statsEnable();
+      break;
+
     case CTRL_KEY('l'):
     case '\x1b':
       break;
@@ -824,16 +4821,17 @@ int editorProcessKeyPress(){
       break;
 
   }
+  undoEnd();
+  if (conf.dirty != dirty) conf.edit_time = time(NULL);
   dirty_q = 0;
   return 0;
 }
 
-void editorDrawMessageBar(struct abuf *ab) {
-  abAppend(ab, "\x1b[K", 3);
+void editorDrawMessageBar(struct screenBuffer *frame) {
   int msglen = strlen(conf.statusmsg);
   if (msglen > conf.screencols) msglen = conf.screencols;
-  if (msglen && time(NULL) - conf.statusmsg_time < 5)
-    abAppend(ab, conf.statusmsg, msglen);
+  if (msglen && time(NULL) - conf.statusmsg_time < STATUS_MSG_SECS)
+    screenPutText(frame, conf.screenrows + 1, 0, conf.statusmsg, msglen, HL_NORMAL);
 }
 
 
@@ -844,75 +4842,100 @@ void initEditor() {
   conf.rx = conf.cx = conf.cy = 0;
   conf.nrows = 0;
   conf.rowoff = conf.coloff = 0;
-  conf.row = NULL;
+  conf.rope = NULL;
+  memset(&conf.map, 0, sizeof(conf.map));
   conf.dirty = 0;
   conf.filename = NULL;
   conf.statusmsg[0] = '\0';
   conf.statusmsg_time = 0;
   conf.syntax = NULL;
+  conf.hl_gen = 1;
+  conf.search.current = -1;
+  conf.search.hl_row = -1;
+  conf.hl_frontier = 0;
+  memset(&conf.frame, 0, sizeof(conf.frame));
+  memset(&conf.screen, 0, sizeof(conf.screen));
+  memset(&conf.save, 0, sizeof(conf.save));
+  memset(&conf.journal, 0, sizeof(conf.journal));
+  conf.journal.fd = -1;
+  conf.screen_valid = 0;
+  conf.frames = conf.frame_bytes = conf.total_frame_bytes = 0;
+  conf.hl_stats = getenv("ZUMA_HL_STATS") != NULL;
+  conf.hl_bytes = conf.hl_ns = 0;
 
   if (getWindowSize(&conf.screenrows, &conf.screencols) == -1)
     die("getWindowSize");
+  screenResize(&conf.frame, conf.screenrows, conf.screencols);
   conf.screenrows -= 2;
+  editorInitSGR();
 }
 
 
 
-void editorDrawRows(struct abuf *ab) {
+// rows the view has moved off give up their render and hl
+void editorReleaseRows(int from, int to) {
+  for (int r = from; r < to && r < conf.nrows; r++) {
+    if (r >= conf.rowoff && r < conf.rowoff + conf.screenrows) continue;
+    int slot;
+    struct ropeNode *leaf = ropeFindLeaf(r, &slot);
+    if (leaf && !leaf->lazy) editorRowRelease(leaf->u.rows[slot]);
+  }
+}
+
+void editorDrawRows(struct screenBuffer *frame) {
+  if (conf.drawn_off != conf.rowoff || conf.drawn_rows != conf.screenrows) {
+    editorReleaseRows(conf.drawn_off, conf.drawn_off + conf.drawn_rows);
+    conf.drawn_off = conf.rowoff;
+    conf.drawn_rows = conf.screenrows;
+  }
   for (int y = 0; y < conf.screenrows; y++) {
-    int filerow = y + conf.rowoff;
-    if (y + conf.rowoff >= conf.nrows) {
-      abAppend(ab, "~", 1);
+    struct editorRow *row = editorRenderRow(y + conf.rowoff);
+    if (!row) {
+      screenPutText(frame, y, 0, "~", 1, HL_NORMAL);
     } else {
-      // adjustment
-      int len = conf.row[y+conf.rowoff].rsize - conf.coloff;
-      len = (len < 0) ? 0 : len;
-      if (len > conf.screencols) len = conf.screencols;
-
-      char *c = &conf.row[filerow].render[conf.coloff];
-      unsigned char *hl = &conf.row[filerow].hl[conf.coloff];
-      int current_color = -1;
+      // copy the visible text and its classes whole, a long row's being
+      // made just for the window, then patch control characters, which
+      // show reversed in the color of the run they're in
+      char *fc = &frame->chars[y * frame->cols];
+      unsigned char *fa = &frame->attrs[y * frame->cols];
+      int len;
+      if (row->flags & ROW_LONG) {
+        len = longRowWindow(row, conf.coloff, conf.screencols, fc, fa);
+      } else {
+        len = row->rsize - conf.coloff;
+        len = (len < 0) ? 0 : len;
+        if (len > conf.screencols) len = conf.screencols;
+        if (len > 0) {
+          memcpy(fc, &row->render[conf.coloff], len);
+          memcpy(fa, &row->hl[conf.coloff], len);
+        }
+      }
+      if (len == 0) continue;
+      int current_hl = HL_NORMAL;
       int j;
       for (j = 0; j < len; j++) {
-        if (iscntrl(c[j])) {
-          char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-          abAppend(ab, "\x1b[7m", 4);
-          abAppend(ab, &sym, 1);
-          abAppend(ab, "\x1b[m", 3);
-          if (current_color != -1) {
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-            abAppend(ab, buf, clen);
-          }
-        } else if (hl[j] == HL_NORMAL) {
-          if (current_color != -1) {
-            abAppend(ab, "\x1b[39m", 5);
-            current_color = -1;
-          }
-            abAppend(ab, &c[j], 1);
+        if (iscntrl(fc[j])) {
+          fc[j] = (fc[j] <= 26) ? '@' + fc[j] : '?';
+          fa[j] = current_hl | ATTR_REVERSE;
         } else {
-          int color = editorSyntaxToColor(hl[j]);
-          if (color != current_color) {
-            current_color = color;
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-            abAppend(ab, buf, clen);
-          }
-          abAppend(ab, &c[j], 1);
+          current_hl = fa[j];
         }
       }
-      abAppend(ab, "\x1b[39m", 5);
+      if (y + conf.rowoff == conf.search.hl_row) {
+        struct editorSearch *s = &conf.search;
+        int from = editorRowCxToRx(row, s->hl_col) - conf.coloff;
+        int to = editorRowCxToRx(row, s->hl_col + s->hl_len) - conf.coloff;
+        for (j = (from < 0) ? 0 : from; j < to && j < len; j++)
+          fa[j] = HL_MATCH | (fa[j] & ATTR_REVERSE);
+      }
     }
-    // clear lines one at a time
-    abAppend(ab, "\x1b[K", 3);
-    abAppend(ab, "\r\n", 2);
   }
 }
 
 void editorVScroll() {
   conf.rx = 0;
   if (conf.cy < conf.nrows) {
-    conf.rx = editorRowCxToRx(&conf.row[conf.cy], conf.cx);
+    conf.rx = editorRowCxToRx(editorRowAt(conf.cy), conf.cx);
   }
   if (conf.cy < conf.rowoff) {
     conf.rowoff = conf.cy;
@@ -933,55 +4956,63 @@ void editorHScroll(){
 
 
 
-void editorDrawStatusBar(struct abuf *ab) {
-  abAppend(ab, "\x1b[7m", 4);
-  char status[80], rstatus[80];
-  int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-    conf.filename ? conf.filename : "[New File]",
-    conf.nrows, conf.dirty ? "*" : "");
+void editorDrawStatusBar(struct screenBuffer *frame) {
+  char status[160], rstatus[80];
+  int len;
+  if (stats.overlay)
+    len = statsFormat(status, sizeof(status));
+  else
+    len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
+      conf.filename ? conf.filename : "[New File]",
+      conf.nrows, conf.dirty ? "*" : "");
+  if (len >= (int) sizeof(status)) len = sizeof(status) - 1;
 
   int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
-    conf.syntax ? conf.syntax->filetype : "no ft", conf.cy + 1, conf.nrows);
+    conf.syntax ? syntaxName(conf.syntax) : "no ft", conf.cy + 1, conf.nrows);
 
+  int y = conf.screenrows;
   if (len > conf.screencols) len = conf.screencols;
-  abAppend(ab, status, len);
+  screenPutText(frame, y, 0, status, len, HL_NORMAL | ATTR_REVERSE);
   while (len < conf.screencols) {
     if (conf.screencols - len == rlen) {
-      abAppend(ab, rstatus, rlen);
+      screenPutText(frame, y, len, rstatus, rlen, HL_NORMAL | ATTR_REVERSE);
       break;
     } else {
-      abAppend(ab, " ", 1);
+      screenPutText(frame, y, len, " ", 1, HL_NORMAL | ATTR_REVERSE);
       len++;
     }
   }
-  abAppend(ab, "\x1b[m", 3);
-  abAppend(ab, "\r\n", 2);
 }
 
 void editorRefreshScreen(){
+  static struct abuf ab = ABUF_INIT;
   editorVScroll();
   editorHScroll();
-  struct abuf ab = ABUF_INIT;
+  abReset(&ab);
 
+  // synchronized update: terminals that know it show the frame at once
+  // rather than as it arrives, and the rest ignore it
+  abAppend(&ab, "\x1b[?2026h", 8);
   abAppend(&ab, "\x1b[?25l", 6);
-  abAppend(&ab, "\x1b[H", 3);
 
-  editorDrawRows(&ab);
-  editorDrawStatusBar(&ab);
-  editorDrawMessageBar(&ab);
+  screenClear(&conf.frame);
+  editorDrawRows(&conf.frame);
+  editorDrawStatusBar(&conf.frame);
+  editorDrawMessageBar(&conf.frame);
+  editorFlushFrame(&ab);
 
   // move the cursor to .cx,.cy position
-  char buf[32];
-  snprintf(buf, sizeof(buf), "\x1b[%d;%dH",
-           conf.cy + 1 - conf.rowoff,
-           conf.rx + 1 - conf.coloff);
-  abAppend(&ab, buf, strlen(buf));
+  abAppendCursor(&ab, conf.cy - conf.rowoff, conf.rx - conf.coloff);
 
   // hide the cursor when repainting
   abAppend(&ab, "\x1b[?25h", 6);
+  abAppend(&ab, "\x1b[?2026l", 8);
 
-  write(STDOUT_FILENO, ab.b, ab.len);
-  abFree(&ab);
+  editorWrite(ab.b, ab.len);
+  statsPainted(ab.len);
+  conf.frames++;
+  conf.frame_bytes = ab.len;
+  conf.total_frame_bytes += ab.len;
 }
 
 char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
@@ -991,8 +5022,9 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
   size_t buflen = 0;
   buf[0] = '\0';
 
+  // set before the callback, so a message from it shows until the next key
+  editorSetStatusMessage(prompt, buf);
   while (1) {
-    editorSetStatusMessage(prompt, buf);
     editorRefreshScreen();
     int c = editorReadKey();
     if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
@@ -1008,6 +5040,16 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
         if (callback) callback(buf, c);
         return buf;
       }
+    } else if (c == PASTE) {
+      // a pasted line goes in up to its end
+      size_t n = editorLineBreak(input.paste, input.paste + input.paste_len) - input.paste;
+      if (buflen + n >= bufsize) {
+        bufsize = (buflen + n) * 2;
+        buf = realloc(buf, bufsize);
+      }
+      for (size_t j = 0; j < n; j++)
+        if (!iscntrl(input.paste[j])) buf[buflen++] = input.paste[j];
+      buf[buflen] = '\0';
     } else if (!iscntrl(c) && c < 128) {
       if (buflen == bufsize - 1) {
         bufsize *= 2;
@@ -1016,22 +5058,63 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
       buf[buflen++] = c;
       buf[buflen] = '\0';
     }
+    editorSetStatusMessage(prompt, buf);
     if (callback) callback(buf, c);
   }
 }
 
+// bench/kernels.c builds the editor in with a main of its own
+#ifndef ZUMA_NO_MAIN
 int main(int argc, char** argv)
 {
-  enableRawMode();
+  editorReplayInit();
+  if (!editorReplaying()) enableRawMode();
   initEditor();
+  editorInitEvents();
+  editorTasksInit();
+  editorSetStatusMessage("HELP: Ctrl-S save | Ctrl-Q quit | Ctrl-F find | Ctrl-R regex | Ctrl-Z/Y undo");
+  editorLoadSyntax();
   if (argc >= 2) editorOpen(argv[1]);
+  undoInit();
   int response;
-  editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
 
   do {
-    editorRefreshScreen();
+    // keys already read in get handled before the next repaint
+    if (!editorInputPending()) editorRefreshScreen();
     response = editorProcessKeyPress();
   } while (!response);
-
+  // a save still being written is let finish
+  editorSavePoll(1);
+  editorJournalClose();
+  if (editorReplaying()) editorReplayReport();
+
+  // ZUMA_FRAME_STATS=1 reports how much was written to the terminal
+  if (getenv("ZUMA_FRAME_STATS") && conf.frames) {
+    fprintf(stderr, "zuma: %lu frames, %lu bytes written, %.1f bytes/frame\r\n",
+            conf.frames, conf.total_frame_bytes,
+            (double) conf.total_frame_bytes / conf.frames);
+  }
+  // ZUMA_MEM_STATS=1 reports what the rows built so far hold
+  if (getenv("ZUMA_MEM_STATS") && conf.nrows) {
+    size_t bytes = 0;
+    int built = 0;
+    for (struct ropeNode *leaf = ropeFirstLeaf(); leaf; leaf = leaf->next) {
+      if (leaf->lazy) continue;
+      for (int j = 0; j < leaf->n; j++) bytes += editorRowBytes(leaf->u.rows[j]);
+      built += leaf->n;
+    }
+    fprintf(stderr, "zuma: %d of %d rows built, %.1f bytes per built row\r\n",
+            built, conf.nrows, built ? (double) bytes / built : 0.0);
+    struct rowHeap *h = &conf.heap;
+    fprintf(stderr, "zuma: row storage %lu allocs (%lu reused, %lu large), %lu frees, "
+            "%zu KB live in %zu KB of slabs, %zu KB of text read at open\r\n",
+            h->allocs, h->reused, h->large, h->frees,
+            h->live_bytes / 1024, h->slab_bytes / 1024, h->text_bytes / 1024);
+  }
+  if (conf.hl_stats && conf.hl_ns) {
+    fprintf(stderr, "zuma: %.1f MB highlighted at %.1f MB/s\r\n",
+            conf.hl_bytes / 1e6, conf.hl_bytes * 1e3 / conf.hl_ns);
+  }
   return 0;
 }
+#endif
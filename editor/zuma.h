@@ -1,9 +1,51 @@
 #ifndef _ZUMA_H
 #define _ZUMA_H
 
+enum editorHighlight {
+  HL_NORMAL = 0,
+  HL_COMMENT,
+  HL_MLCOMMENT,
+  HL_KEYWORD1,
+  HL_KEYWORD2,
+  HL_STRING,
+  HL_NUMBER,
+  HL_MATCH,
+  HL_CLASSES
+};
+
 struct editorRow;
+struct editorSyntax;
+void die(const char *s);
 char *editorPrompt(char *, void (*callback)(char *, int));
 void editorSelectSyntaxHighlight();
-void editorUpdateSyntax(struct editorRow*);
+void editorUpdateSyntax(int filerow);
+void editorRefreshScreen();
+
+// regex.c
+struct regex;
+struct regex *regexCompile(const char *pattern, const char **err);
+int regexSearch(struct regex *re, const char *text, int len, int *start, int *end);
+void regexFree(struct regex *re);
+
+
+// syntax.c
+int syntaxLoadFile(const char *path, const char **err, int *errline);
+struct editorSyntax *syntaxSelect(const char *filename);
+const char *syntaxName(struct editorSyntax *s);
+int syntaxIsStateful(struct editorSyntax *s);
+int syntaxReach(struct editorSyntax *s);
+int syntaxHighlightLine(struct editorSyntax *s, const char *text, int len,
+                        unsigned char *hl, int in_comment);
+
+// where the lexer stopped part way through a line, to carry on from there
+struct lexState {
+  unsigned char in_comment;       // inside a block comment
+  unsigned char prev_sep;         // the byte before was a separator
+  unsigned char prev_number;      // the byte before was part of a number
+  unsigned char quote;            // inside a string opened by this byte
+  unsigned char line_comment;     // the rest of the line is a comment
+};
+int syntaxLexFrom(struct editorSyntax *s, const char *text, int len, int from,
+                  int to, unsigned char *hl, struct lexState *st);
 
 #endif